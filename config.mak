@@ -1,3 +1,15 @@
 PLUGIN_NAME = mp2k-clef
 -include libclef/config.mak
 -include ../libclef/config.mak
+
+# The song scanner and decoders use std::thread
+CXXFLAGS_R += -pthread
+CXXFLAGS_D += -pthread
+LDFLAGS_R += -pthread
+LDFLAGS_D += -pthread
+
+# TRACE=1 builds in the playback diagnostics written by --trace
+ifeq ($(TRACE),1)
+CXXFLAGS_R += -DMP2K_ENABLE_TRACE
+CXXFLAGS_D += -DMP2K_ENABLE_TRACE
+endif
@@ -1,11 +1,16 @@
 #include "plugin/baseplugin.h"
 #include "codec/sampledata.h"
 #include "romfile.h"
+#include "romstore.h"
 #include "songtable.h"
 #include "songdata.h"
+#include "songanalysis.h"
+#include "scancache.h"
+#include "lrucache.h"
 #include <sstream>
 #include <iomanip>
-#include <map>
+#include <algorithm>
+#include <stdexcept>
 
 #ifdef BUILD_CLAP
 #include "plugin/clapplugin.h"
@@ -23,14 +28,17 @@ static SynthContext* openBySubsong(ClefContext* ctx, std::unique_ptr<ROMFile>& r
     size_t qpos = filename.rfind('?');
     std::string baseFile = filename.substr(0, qpos);
     bool alreadyLoaded = rom && rom->filename == baseFile;
-    if (!alreadyLoaded) {
-      rom.reset(new ROMFile(ctx));
-    }
-    if (file) {
-      rom->load(synth, file, baseFile);
+    if (alreadyLoaded) {
+      // The stream may already have been consumed
+      rom->load(synth, rom->rom, baseFile);
     } else {
-      auto newFile(ctx->openFile(baseFile));
-      rom->load(synth, *newFile, baseFile);
+      rom.reset(new ROMFile(ctx));
+      if (file) {
+        rom->load(synth, ROMStore::instance()->open(baseFile, file), baseFile);
+      } else {
+        auto newFile(ctx->openFile(baseFile));
+        rom->load(synth, ROMStore::instance()->open(baseFile, *newFile), baseFile);
+      }
     }
 
     if (ctx->isDawPlugin) {
@@ -51,13 +59,18 @@ static SynthContext* openBySubsong(ClefContext* ctx, std::unique_ptr<ROMFile>& r
       }
       if (subsong.substr(0, 2) == "0x") {
         uint32_t addr = std::stoi(subsong, nullptr, 0);
-        songData.reset(new SongData(rom.get(), addr));
+        std::unique_ptr<SongData> song(new SongData(rom.get(), addr));
+        song->decodeAll();
+        songData = std::move(song);
       } else {
         SongTable st = rom->findSongTable(-1);
         int index = std::stoi(subsong.empty() ? "0" : subsong);
         do {
           try {
-            songData.reset(st.songFromTable(index));
+            // Only keep songs that decode successfully
+            std::unique_ptr<SongData> song(st.songFromTable(index));
+            song->decodeAll();
+            songData = std::move(song);
             break;
           } catch (std::exception& e) {
             ++index;
@@ -81,8 +94,87 @@ static SynthContext* openBySubsong(ClefContext* ctx, std::unique_ptr<ROMFile>& r
   }
 }
 
-static std::map<std::string, double> durationCache;
-static std::map<std::string, std::vector<std::string>> subsongCache;
+// Hosts may ask about files from several threads at once. The caches are
+// bounded so that a long session with a large library doesn't keep growing.
+static LRUCache<std::string, double> durationCache(4096);
+static LRUCache<std::string, std::vector<std::string>> subsongCache(256);
+// Like the thread pool, this is never destroyed. Unloading the library stops
+// the enumerations through SongEnumerator::shutdown() instead.
+static auto* enumerations = new LRUCache<std::string, std::shared_ptr<SongEnumerator>>(16);
+
+// Destroyed when the library is unloaded, before the code the enumeration
+// workers run goes away.
+static struct EnumerationShutdown {
+  ~EnumerationShutdown() { SongEnumerator::shutdown(); }
+} enumerationShutdown;
+
+static std::string subsongName(const std::string& base, uint32_t addr)
+{
+  std::ostringstream ss;
+  ss << base << "?0x" << std::hex << std::setw(6) << std::setfill('0') << addr;
+  return ss.str();
+}
+
+static std::shared_ptr<SongEnumerator> enumerateSongs(const std::string& base, std::istream& file)
+{
+  return enumerations->getOrCompute(base, [&base, &file]{
+    // The enumeration can outlive the host's context, so it doesn't get one.
+    std::unique_ptr<ROMFile> rom(new ROMFile(nullptr));
+    rom->load(nullptr, ROMStore::instance()->open(base, file), base);
+    SongTable st = rom->findAllSongs();
+    return std::shared_ptr<SongEnumerator>(new SongEnumerator(rom.release(), st.songs));
+  });
+}
+
+// Uses the enumeration's result if there is one. Returns false if the song
+// can't be decoded.
+static bool songLength(const ROMFile* rom, SongEnumerator* songs, uint32_t addr, double& length)
+{
+  SongAnalysis analysis;
+  size_t index = songs ? std::find(songs->songs.begin(), songs->songs.end(), addr) - songs->songs.begin() : 0;
+  if (songs && index < songs->songs.size()) {
+    if (songs->waitForSong(index, analysis)) {
+      length = analysis.duration;
+      return true;
+    } else if (!songs->isCancelled()) {
+      return false;
+    }
+  }
+  ScanCache* cache = rom->scanCache();
+  if (cache && cache->songAnalysis(addr, analysis)) {
+    length = analysis.duration;
+    return analysis.numTracks >= 0;
+  }
+  try {
+    length = analyzeSong(rom, addr).duration;
+    return true;
+  } catch (...) {
+    return false;
+  }
+}
+
+// The length of the song openBySubsong() plays for the given subsong, or 0 if
+// there isn't one.
+static double subsongLength(const ROMFile* rom, SongEnumerator* songs, const std::string& subsong)
+{
+  double length = 0;
+  if (subsong.substr(0, 2) == "0x") {
+    songLength(rom, songs, std::stoul(subsong, nullptr, 0), length);
+    return length;
+  }
+  // Songs from the table are skipped until one decodes.
+  SongTable st = rom->findSongTable(-1);
+  for (size_t index = std::stoul(subsong.empty() ? "0" : subsong); index < st.songs.size(); index++) {
+    try {
+      if (songLength(rom, songs, rom->readPointer(st.tableStart + 8 * index), length)) {
+        return length;
+      }
+    } catch (...) {
+      // try the next one
+    }
+  }
+  return 0;
+}
 
 struct ClefPluginInfo {
   CLEF_PLUGIN_STATIC_FIELDS
@@ -107,40 +199,19 @@ struct ClefPluginInfo {
 
   static double length(ClefContext* ctx, const std::string& filename, std::istream& file) {
     // Implementations should return the length of the file in seconds.
-    auto iter = durationCache.find(filename);
-    if (iter != durationCache.end()) {
-      return iter->second;
-    }
-    size_t qpos = filename.rfind('?');
-    std::string base = filename.substr(0, qpos);
-    std::unique_ptr<ROMFile> lengthRom(new ROMFile(ctx));
-    lengthRom->load(nullptr, file, base);
-    SongTable st = lengthRom->findAllSongs();
-    std::vector<std::string> subsongs;
-    bool first = true;
-    for (uint32_t song : st.songs) {
-      std::ostringstream ss;
-      ss << base << "?0x" << std::hex << std::setw(6) << std::setfill('0') << song;
-      std::string subsong = ss.str();
-
-      std::unique_ptr<SongData> lengthSong;
-      double length = 0;
-      try {
-        std::unique_ptr<SynthContext> synth(openBySubsong(ctx, lengthRom, lengthSong, subsong, file));
-        if (synth) {
-          length = synth->maximumTime();
-          subsongs.push_back(subsong);
-        }
-      } catch (...) {
-        // ignore
+    return durationCache.getOrCompute(filename, [ctx, &filename, &file]{
+      size_t qpos = filename.rfind('?');
+      std::string base = filename.substr(0, qpos);
+      std::string subsong = qpos == std::string::npos ? "" : filename.substr(qpos + 1);
+      std::shared_ptr<SongEnumerator> songs;
+      if (enumerations->get(base, songs)) {
+        return subsongLength(songs->romFile(), songs.get(), subsong);
       }
-      durationCache[subsong] = length;
-      if (first && filename != subsong) {
-        durationCache[filename] = length;
-      }
-    }
-    subsongCache[base] = subsongs;
-    return durationCache[filename];
+      // Only this song is needed, so don't start analyzing the rest of them.
+      ROMFile rom(ctx);
+      rom.load(nullptr, ROMStore::instance()->open(base, file), base);
+      return subsongLength(&rom, nullptr, subsong);
+    });
   }
 
   static TagMap readTags(ClefContext* ctx, const std::string& filename, std::istream& file) {
@@ -153,14 +224,29 @@ struct ClefPluginInfo {
   static std::vector<std::string> getSubsongs(ClefContext* clef, const std::string& filename, std::istream& file)
   {
     std::string base = filename.substr(0, filename.rfind('?'));
-
-    auto iter = subsongCache.find(base);
-    if (iter != subsongCache.end()) {
-      return iter->second;
-    }
-    subsongCache[base] = std::vector<std::string>();
-    length(clef, base, file);
-    return subsongCache.at(base);
+    return subsongCache.getOrCompute(base, [&base, &file]{
+      std::shared_ptr<SongEnumerator> songs = enumerateSongs(base, file);
+      if (!songs->waitForAll()) {
+        // The host dropped the file, so don't cache a partial list.
+        throw std::runtime_error("subsong enumeration cancelled");
+      }
+      std::vector<std::string> subsongs;
+      for (size_t i = 0; i < songs->songs.size(); i++) {
+        // Only list songs that decode successfully, but remember the others
+        // too so that asking for them again doesn't analyze them again.
+        double length = 0;
+        std::string subsong = subsongName(base, songs->songs[i]);
+        if (songLength(songs->romFile(), songs.get(), songs->songs[i], length)) {
+          subsongs.push_back(subsong);
+        }
+        durationCache.put(subsong, length);
+      }
+      durationCache.put(base, subsongLength(songs->romFile(), songs.get(), ""));
+      // Every result has been published, so the enumeration isn't needed anymore.
+      std::shared_ptr<SongEnumerator> finished;
+      enumerations->take(base, finished);
+      return subsongs;
+    });
   }
 
   SynthContext* prepare(ClefContext* ctx, const std::string& filename, std::istream& file) {
@@ -176,6 +262,14 @@ struct ClefPluginInfo {
 
   void release() {
     // Release any retained state allocated in prepare().
+    if (rom) {
+      // The host is done with the file, so stop analyzing its songs. A length()
+      // still waiting on one analyzes just that song instead.
+      std::shared_ptr<SongEnumerator> songs;
+      if (enumerations->take(rom->filename, songs)) {
+        songs->cancel();
+      }
+    }
     songData.reset(nullptr);
     rom.reset(nullptr);
   }
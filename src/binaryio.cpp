@@ -0,0 +1,185 @@
+#include "binaryio.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+void BinaryWriter::write(double value)
+{
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  write<uint64_t>(bits);
+}
+
+void BinaryWriter::writeString(const std::string& value)
+{
+  write<uint32_t>(value.size());
+  buffer += value;
+}
+
+void BinaryWriter::writeBytes(const void* data, size_t size)
+{
+  buffer.append(reinterpret_cast<const char*>(data), size);
+}
+
+void BinaryWriter::align(size_t alignment)
+{
+  while (buffer.size() % alignment) {
+    buffer.push_back('\0');
+  }
+}
+
+bool BinaryWriter::saveAtomic(const std::string& path) const
+{
+  std::ostringstream tmpName;
+  tmpName << path << ".tmp" << std::hash<std::thread::id>()(std::this_thread::get_id());
+#ifdef _WIN32
+  tmpName << "." << GetCurrentProcessId();
+#else
+  tmpName << "." << getpid();
+#endif
+  std::string tmpPath = tmpName.str();
+  {
+    std::ofstream f(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    f.write(buffer.data(), buffer.size());
+    f.close();
+    if (!f) {
+      std::remove(tmpPath.c_str());
+      return false;
+    }
+  }
+#ifdef _WIN32
+  bool ok = MoveFileExA(tmpPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+  bool ok = std::rename(tmpPath.c_str(), path.c_str()) == 0;
+#endif
+  if (!ok) {
+    std::remove(tmpPath.c_str());
+  }
+  return ok;
+}
+
+BinaryReader::BinaryReader(const uint8_t* data, size_t size)
+: ptr(data), len(size), pos(0), failed(false)
+{
+  // initializers only
+}
+
+BinaryReader::BinaryReader(const std::string& data)
+: ptr(reinterpret_cast<const uint8_t*>(data.data())), len(data.size()), pos(0), failed(false)
+{
+  // initializers only
+}
+
+bool BinaryReader::require(size_t size)
+{
+  if (failed || len - pos < size) {
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool BinaryReader::read(double& value)
+{
+  uint64_t bits;
+  if (!read<uint64_t>(bits)) {
+    return false;
+  }
+  std::memcpy(&value, &bits, sizeof(bits));
+  return true;
+}
+
+bool BinaryReader::readString(std::string& value)
+{
+  uint32_t size;
+  if (!read<uint32_t>(size) || !require(size)) {
+    return false;
+  }
+  value.assign(reinterpret_cast<const char*>(ptr + pos), size);
+  pos += size;
+  return true;
+}
+
+bool BinaryReader::skip(size_t size)
+{
+  if (!require(size)) {
+    return false;
+  }
+  pos += size;
+  return true;
+}
+
+bool BinaryReader::align(size_t alignment)
+{
+  size_t padding = (alignment - pos % alignment) % alignment;
+  return skip(padding);
+}
+
+bool readWholeFile(const std::string& path, std::string& data)
+{
+  std::ifstream f(path, std::ios::in | std::ios::binary);
+  if (!f) {
+    return false;
+  }
+  std::ostringstream ss;
+  ss << f.rdbuf();
+  data = ss.str();
+  return true;
+}
+
+static bool makeDir(const std::string& path)
+{
+#ifdef _WIN32
+  return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+  return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+bool makePath(const std::string& path)
+{
+  for (size_t pos = path.find_first_of("/\\", 1); pos != std::string::npos; pos = path.find_first_of("/\\", pos + 1)) {
+    makeDir(path.substr(0, pos));
+  }
+  return makeDir(path);
+}
+
+std::string cacheDirectory()
+{
+  const char* env = std::getenv("MP2K_CLEF_NO_CACHE");
+  if (env && *env) {
+    return std::string();
+  }
+  env = std::getenv("MP2K_CLEF_CACHE");
+  if (env && *env) {
+    return env;
+  }
+#ifdef _WIN32
+  env = std::getenv("LOCALAPPDATA");
+  if (env && *env) {
+    return std::string(env) + "\\mp2k-clef";
+  }
+#else
+  env = std::getenv("XDG_CACHE_HOME");
+  if (env && *env) {
+    return std::string(env) + "/mp2k-clef";
+  }
+  env = std::getenv("HOME");
+  if (env && *env) {
+    return std::string(env) + "/.cache/mp2k-clef";
+  }
+#endif
+  return std::string();
+}
@@ -0,0 +1,91 @@
+#ifndef GBAMP2WAV_BINARYIO_H
+#define GBAMP2WAV_BINARYIO_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <type_traits>
+
+// Little-endian serialization helpers for the on-disk caches.
+
+class BinaryWriter {
+public:
+  template<typename T> void write(T value) {
+    typename std::make_unsigned<T>::type bits = value;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      buffer.push_back(char(bits & 0xFF));
+      bits >>= 8;
+    }
+  }
+  void write(double value);
+  // Overwrites bytes that were already written, such as a placeholder offset.
+  template<typename T> void writeAt(size_t offset, T value) {
+    typename std::make_unsigned<T>::type bits = value;
+    for (size_t i = 0; i < sizeof(T); i++) {
+      buffer[offset + i] = char(bits & 0xFF);
+      bits >>= 8;
+    }
+  }
+  void writeString(const std::string& value);
+  void writeBytes(const void* data, size_t size);
+  void align(size_t alignment);
+
+  inline size_t size() const { return buffer.size(); }
+  inline const std::string& data() const { return buffer; }
+
+  // Writes to a temporary file next to `path` and renames it into place, so
+  // readers never see a partial file.
+  bool saveAtomic(const std::string& path) const;
+
+private:
+  std::string buffer;
+};
+
+class BinaryReader {
+public:
+  BinaryReader(const uint8_t* data, size_t size);
+  BinaryReader(const std::string& data);
+
+  // Each read returns false, and leaves the reader failed, if the data is truncated.
+  template<typename T> bool read(T& value) {
+    if (!require(sizeof(T))) {
+      return false;
+    }
+    typename std::make_unsigned<T>::type bits = 0;
+    for (int i = sizeof(T) - 1; i >= 0; --i) {
+      bits = (bits << 8) | ptr[pos + i];
+    }
+    value = T(bits);
+    pos += sizeof(T);
+    return true;
+  }
+  bool read(double& value);
+  bool readString(std::string& value);
+  bool skip(size_t size);
+  bool align(size_t alignment);
+
+  inline size_t offset() const { return pos; }
+  inline bool ok() const { return !failed; }
+  inline bool atEnd() const { return pos >= len; }
+  inline const uint8_t* current() const { return ptr + pos; }
+
+private:
+  bool require(size_t size);
+
+  const uint8_t* ptr;
+  size_t len, pos;
+  bool failed;
+};
+
+// Reads an entire file into `data`. Returns false if it can't be opened.
+bool readWholeFile(const std::string& path, std::string& data);
+
+// Creates a directory and any missing parents.
+bool makePath(const std::string& path);
+
+// Per-user directory for persistent caches, or an empty string if none is
+// available or caching is disabled with the MP2K_CLEF_NO_CACHE environment
+// variable. MP2K_CLEF_CACHE overrides the location.
+std::string cacheDirectory();
+
+#endif
@@ -0,0 +1,188 @@
+#include "compiledsong.h"
+#include "romfile.h"
+#include "songdata.h"
+#include "instrumentdata.h"
+#include "binaryio.h"
+#include "synth/synthcontext.h"
+#include <cstring>
+#include <set>
+
+static const char COMPILED_SONG_MAGIC[8] = { 'M', 'P', '2', 'K', 'S', 'O', 'N', 'G' };
+// Increment whenever the file layout or the meaning of a decoded event changes.
+static const uint32_t COMPILED_SONG_VERSION = 1;
+static const size_t EVENT_RECORD_SIZE = 6;
+
+bool saveCompiledSong(const SongData& song, const std::string& path)
+{
+  const ROMFile* rom = song.rom;
+  SynthContext* synth = rom->synthContext();
+  if (!synth) {
+    return false;
+  }
+
+  std::vector<const TrackData*> tracks;
+  try {
+    for (int i = 0; i < song.numTracks(); i++) {
+      tracks.push_back(static_cast<const TrackData*>(song.getTrack(i)));
+      tracks.back()->decodeEvents();
+    }
+  } catch (std::exception& e) {
+    return false;
+  }
+
+  std::set<uint32_t> instAddrs;
+  for (uint32_t addr : song.instruments.instruments) {
+    if (addr) {
+      if (!synth->getInstrument(addr)) {
+        return false;
+      }
+      instAddrs.insert(addr);
+    }
+  }
+
+  BinaryWriter writer;
+  writer.writeBytes(COMPILED_SONG_MAGIC, sizeof(COMPILED_SONG_MAGIC));
+  writer.write<uint32_t>(COMPILED_SONG_VERSION);
+  writer.write<uint64_t>(rom->contentHash());
+  writer.write<uint32_t>(rom->rom.size());
+  writer.write<uint8_t>(rom->multiboot);
+  writer.align(4);
+  writer.write<uint32_t>(song.addr);
+  size_t instOffsetPos = writer.size();
+  writer.write<uint32_t>(0);
+  writer.write<uint32_t>(instAddrs.size());
+  for (uint32_t addr : song.instruments.instruments) {
+    writer.write<uint32_t>(addr);
+  }
+
+  writer.write<uint32_t>(tracks.size());
+  size_t directoryPos = writer.size();
+  for (const TrackData* track : tracks) {
+    writer.write<uint32_t>(track->addr);
+    // Offset filled in below
+    writer.write<uint32_t>(0);
+    writer.write<uint32_t>(track->events().size());
+  }
+
+  writer.writeAt<uint32_t>(instOffsetPos, writer.size());
+  for (uint32_t addr : instAddrs) {
+    static_cast<const MpInstrument*>(synth->getInstrument(addr))->write(writer);
+  }
+
+  for (size_t i = 0; i < tracks.size(); i++) {
+    writer.align(4);
+    writer.writeAt<uint32_t>(directoryPos + i * 12 + 4, writer.size());
+    for (const Mp2kEvent& ev : tracks[i]->events()) {
+      writer.write<uint16_t>(ev.value);
+      writer.write<uint8_t>(ev.type);
+      writer.write<uint8_t>(ev.param);
+      writer.write<uint8_t>(ev.duration);
+      writer.write<uint8_t>(0);
+    }
+  }
+
+  return writer.saveAtomic(path);
+}
+
+static std::shared_ptr<DecodedTrack> readEvents(const uint8_t* data, size_t size, uint32_t offset, uint32_t numEvents)
+{
+  if (offset > size || (size - offset) / EVENT_RECORD_SIZE < numEvents) {
+    return nullptr;
+  }
+  std::shared_ptr<DecodedTrack> track(new DecodedTrack);
+  track->events.resize(numEvents);
+  BinaryReader reader(data + offset, numEvents * EVENT_RECORD_SIZE);
+  for (Mp2kEvent& ev : track->events) {
+    uint8_t type = 0;
+    reader.read(ev.value);
+    reader.read(type);
+    reader.read(ev.param);
+    reader.read(ev.duration);
+    reader.skip(1);
+    ev.type = Mp2kEvent::Type(type);
+    if (type > Mp2kEvent::Stop || (type == Mp2kEvent::Goto && ev.value >= numEvents)) {
+      return nullptr;
+    }
+  }
+  return track;
+}
+
+SongData* loadCompiledSong(const ROMFile* rom, const std::string& path)
+{
+  std::string buffer;
+  ROMBuffer mapped = ROMBuffer::map(path);
+  const uint8_t* data = mapped.data();
+  size_t size = mapped.size();
+  if (mapped.empty()) {
+    if (!readWholeFile(path, buffer)) {
+      return nullptr;
+    }
+    data = reinterpret_cast<const uint8_t*>(buffer.data());
+    size = buffer.size();
+  }
+  BinaryReader reader(data, size);
+
+  char magic[sizeof(COMPILED_SONG_MAGIC)];
+  for (char& ch : magic) {
+    reader.read(ch);
+  }
+  uint32_t version = 0, romSize = 0;
+  uint64_t fileHash = 0;
+  uint8_t multiboot = 0;
+  reader.read(version);
+  reader.read(fileHash);
+  reader.read(romSize);
+  reader.read(multiboot);
+  reader.align(4);
+  if (!reader.ok() || std::memcmp(magic, COMPILED_SONG_MAGIC, sizeof(magic)) || version != COMPILED_SONG_VERSION) {
+    return nullptr;
+  }
+  if (fileHash != rom->contentHash() || romSize != rom->rom.size() || bool(multiboot) != rom->multiboot) {
+    return nullptr;
+  }
+
+  uint32_t songAddr = 0, instOffset = 0, numInsts = 0, numTracks = 0;
+  uint32_t table[128];
+  reader.read(songAddr);
+  reader.read(instOffset);
+  reader.read(numInsts);
+  for (uint32_t& addr : table) {
+    addr = 0;
+    reader.read(addr);
+  }
+  reader.read(numTracks);
+  std::vector<uint32_t> trackAddrs;
+  std::vector<std::shared_ptr<DecodedTrack>> decoded;
+  for (uint32_t i = 0; i < numTracks && reader.ok(); i++) {
+    uint32_t addr = 0, offset = 0, numEvents = 0;
+    reader.read(addr);
+    reader.read(offset);
+    reader.read(numEvents);
+    decoded.push_back(readEvents(data, size, offset, numEvents));
+    if (!decoded.back()) {
+      return nullptr;
+    }
+    trackAddrs.push_back(addr);
+  }
+  if (!reader.ok() || instOffset > size) {
+    return nullptr;
+  }
+
+  SynthContext* synth = rom->synthContext();
+  BinaryReader instReader(data + instOffset, size - instOffset);
+  for (uint32_t i = 0; i < numInsts; i++) {
+    std::unique_ptr<MpInstrument> inst(MpInstrument::read(rom, instReader));
+    if (!inst) {
+      return nullptr;
+    }
+    if (synth && !synth->getInstrument(inst->addr)) {
+      uint32_t addr = inst->addr;
+      synth->registerInstrument(addr, std::unique_ptr<IInstrument>(inst.release()));
+    }
+  }
+
+  for (uint32_t i = 0; i < numTracks; i++) {
+    rom->storeDecodedTrack(trackAddrs[i], decoded[i]);
+  }
+  return new SongData(rom, songAddr, InstrumentData(table), trackAddrs);
+}
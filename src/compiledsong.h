@@ -0,0 +1,25 @@
+#ifndef GBAMP2WAV_COMPILEDSONG_H
+#define GBAMP2WAV_COMPILEDSONG_H
+
+#include <string>
+class ROMFile;
+class SongData;
+
+// A compiled song file holds a fully decoded song: its track event streams and
+// the instrument definitions it uses, with samples referred to by ID. Loading
+// one skips scanning for song tables and parsing the sequence data. The file
+// is tied to the hash of the ROM image it was compiled from, which still
+// supplies the sample data.
+//
+// The layout is a fixed header and track directory followed by 4-byte-aligned
+// blocks, so it can be memory-mapped and each track located by offset. Event
+// records are stored exactly as Mp2kEvent is laid out on little-endian hosts.
+
+// Returns false if the song can't be compiled or the file can't be written.
+bool saveCompiledSong(const SongData& song, const std::string& path);
+
+// Returns nullptr if the file is missing, corrupt, from a different format
+// version, or compiled from a different ROM image.
+SongData* loadCompiledSong(const ROMFile* rom, const std::string& path);
+
+#endif
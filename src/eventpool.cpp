@@ -0,0 +1,53 @@
+#include "eventpool.h"
+#include <new>
+
+EventPool::EventPool()
+{
+  for (FreeBlock*& list : freeLists) {
+    list = nullptr;
+  }
+}
+
+EventPool::~EventPool()
+{
+  for (void* chunk : chunks) {
+    ::operator delete(chunk);
+  }
+}
+
+void* EventPool::allocate(size_t size)
+{
+  size_t sizeClass = (size + BLOCK_ALIGN - 1) / BLOCK_ALIGN;
+  if (!sizeClass || sizeClass > MAX_BLOCK_SIZE / BLOCK_ALIGN) {
+    return ::operator new(size);
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  FreeBlock*& list = freeLists[sizeClass - 1];
+  if (!list) {
+    // Carve a new chunk into blocks of this size
+    size_t blockSize = sizeClass * BLOCK_ALIGN;
+    char* chunk = static_cast<char*>(::operator new(blockSize * BLOCKS_PER_CHUNK));
+    chunks.push_back(chunk);
+    for (size_t i = 0; i < BLOCKS_PER_CHUNK; i++) {
+      FreeBlock* block = reinterpret_cast<FreeBlock*>(chunk + i * blockSize);
+      block->next = list;
+      list = block;
+    }
+  }
+  FreeBlock* block = list;
+  list = block->next;
+  return block;
+}
+
+void EventPool::deallocate(void* ptr, size_t size)
+{
+  size_t sizeClass = (size + BLOCK_ALIGN - 1) / BLOCK_ALIGN;
+  if (!sizeClass || sizeClass > MAX_BLOCK_SIZE / BLOCK_ALIGN) {
+    ::operator delete(ptr);
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  FreeBlock* block = static_cast<FreeBlock*>(ptr);
+  block->next = freeLists[sizeClass - 1];
+  freeLists[sizeClass - 1] = block;
+}
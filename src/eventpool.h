@@ -0,0 +1,64 @@
+#ifndef GBAMP2WAV_EVENTPOOL_H
+#define GBAMP2WAV_EVENTPOOL_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Recycles the memory of sequence events. Blocks are grouped by size, and a
+// freed block goes onto a free list to be handed out again, so once a song has
+// been playing for a while creating an event doesn't call the allocator.
+// Events are created with makePooled(), which places the event and its
+// shared_ptr control block in a single block. The control block keeps the pool
+// alive, so events may safely outlive whatever created them.
+class EventPool {
+public:
+  EventPool();
+  EventPool(const EventPool& other) = delete;
+  EventPool& operator=(const EventPool& other) = delete;
+  ~EventPool();
+
+  void* allocate(size_t size);
+  void deallocate(void* ptr, size_t size);
+
+private:
+  static constexpr size_t BLOCK_ALIGN = 16;
+  static constexpr size_t MAX_BLOCK_SIZE = 256;
+  static constexpr size_t BLOCKS_PER_CHUNK = 64;
+
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  std::mutex lock;
+  FreeBlock* freeLists[MAX_BLOCK_SIZE / BLOCK_ALIGN];
+  std::vector<void*> chunks;
+};
+
+template<typename T>
+class PoolAllocator {
+public:
+  typedef T value_type;
+
+  PoolAllocator(const std::shared_ptr<EventPool>& pool) : pool(pool) {}
+  template<typename U> PoolAllocator(const PoolAllocator<U>& other) : pool(other.pool) {}
+
+  inline T* allocate(size_t n) { return static_cast<T*>(pool->allocate(n * sizeof(T))); }
+  inline void deallocate(T* ptr, size_t n) { pool->deallocate(ptr, n * sizeof(T)); }
+
+  template<typename U> inline bool operator==(const PoolAllocator<U>& other) const { return pool == other.pool; }
+  template<typename U> inline bool operator!=(const PoolAllocator<U>& other) const { return pool != other.pool; }
+
+private:
+  template<typename U> friend class PoolAllocator;
+  std::shared_ptr<EventPool> pool;
+};
+
+template<typename T, typename... Args>
+inline std::shared_ptr<T> makePooled(const std::shared_ptr<EventPool>& pool, Args&&... args)
+{
+  return std::allocate_shared<T>(PoolAllocator<T>(pool), std::forward<Args>(args)...);
+}
+
+#endif
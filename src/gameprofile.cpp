@@ -0,0 +1,113 @@
+#include "gameprofile.h"
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <iterator>
+
+static const GameProfile builtinProfiles[] = {
+  { "AXVE", 0, 0x45548C, 0, 13379, "Pokemon Ruby Version" },
+  { "BPRE", 0, 0x4A32CC, 0, 13379, "Pokemon FireRed Version" },
+  { "BPEE", GameProfile::ANY_REVISION, 0x6B49F0, 0, 13379, "Pokemon Emerald Version" },
+};
+
+static GameProfiles* loadProfiles()
+{
+  static GameProfiles profiles;
+  std::string path = GameProfiles::userProfilePath();
+  if (!path.empty()) {
+    profiles.loadFile(path);
+  }
+  return &profiles;
+}
+
+const GameProfiles* GameProfiles::instance()
+{
+  // Function-local statics are initialized once even with concurrent callers.
+  static const GameProfiles* profiles = loadProfiles();
+  return profiles;
+}
+
+GameProfiles::GameProfiles()
+: profiles(std::begin(builtinProfiles), std::end(builtinProfiles))
+{
+  // initializers only
+}
+
+const GameProfile* GameProfiles::find(const std::string& gameCode, int revision) const
+{
+  for (auto iter = profiles.rbegin(); iter != profiles.rend(); ++iter) {
+    if (iter->gameCode == gameCode && (iter->revision == GameProfile::ANY_REVISION || iter->revision == revision)) {
+      return &*iter;
+    }
+  }
+  return nullptr;
+}
+
+void GameProfiles::add(const GameProfile& profile)
+{
+  profiles.push_back(profile);
+}
+
+int GameProfiles::load(std::istream& stream)
+{
+  int count = 0;
+  std::string line;
+  while (std::getline(stream, line)) {
+    std::istringstream ss(line);
+    GameProfile profile;
+    std::string revision, table;
+    if (!(ss >> profile.gameCode) || profile.gameCode[0] == '#') {
+      continue;
+    }
+    if (profile.gameCode.size() != 4 || !(ss >> revision >> table)) {
+      continue;
+    }
+    try {
+      profile.revision = revision == "*" ? GameProfile::ANY_REVISION : std::stoi(revision, nullptr, 0);
+      // Accept either a file offset or a GBA address
+      profile.songTable = std::stoul(table, nullptr, 0) & 0x01FFFFFF;
+    } catch (std::exception&) {
+      continue;
+    }
+    profile.numSongs = 0;
+    profile.sampleRate = 0;
+    ss >> profile.numSongs >> profile.sampleRate;
+    std::getline(ss >> std::ws, profile.title);
+    add(profile);
+    count++;
+  }
+  return count;
+}
+
+int GameProfiles::loadFile(const std::string& path)
+{
+  std::ifstream f(path);
+  if (!f) {
+    return 0;
+  }
+  return load(f);
+}
+
+std::string GameProfiles::userProfilePath()
+{
+  const char* env = std::getenv("MP2K_CLEF_PROFILES");
+  if (env && *env) {
+    return env;
+  }
+#ifdef _WIN32
+  env = std::getenv("APPDATA");
+  if (env && *env) {
+    return std::string(env) + "\\mp2k-clef\\profiles.txt";
+  }
+#else
+  env = std::getenv("XDG_CONFIG_HOME");
+  if (env && *env) {
+    return std::string(env) + "/mp2k-clef/profiles.txt";
+  }
+  env = std::getenv("HOME");
+  if (env && *env) {
+    return std::string(env) + "/.config/mp2k-clef/profiles.txt";
+  }
+#endif
+  return std::string();
+}
@@ -0,0 +1,52 @@
+#ifndef GBAMP2WAV_GAMEPROFILE_H
+#define GBAMP2WAV_GAMEPROFILE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+
+// Known song table locations for specific games, keyed by the game code and
+// revision in the cartridge header. A profile is only a hint: ROMFile still
+// checks that the table is really there before using it.
+struct GameProfile {
+  static constexpr int ANY_REVISION = -1;
+
+  std::string gameCode;
+  int revision;
+  uint32_t songTable;
+  // 0 if unknown
+  uint32_t numSongs;
+  uint32_t sampleRate;
+  std::string title;
+};
+
+class GameProfiles {
+public:
+  // The built-in profiles, plus any found in the user's profile file.
+  static const GameProfiles* instance();
+
+  GameProfiles();
+
+  // Returns nullptr if there is no matching profile. Profiles added later
+  // take precedence over earlier ones.
+  const GameProfile* find(const std::string& gameCode, int revision) const;
+
+  void add(const GameProfile& profile);
+
+  // Each non-blank line not starting with # has the form:
+  //   CODE REVISION TABLE [SONGS [RATE [TITLE]]]
+  // where REVISION may be * to match any revision. Returns the number of
+  // profiles added; malformed lines are skipped.
+  int load(std::istream& stream);
+  int loadFile(const std::string& path);
+
+  // MP2K_CLEF_PROFILES if set, otherwise profiles.txt in the user's
+  // configuration directory.
+  static std::string userProfilePath();
+
+private:
+  std::vector<GameProfile> profiles;
+};
+
+#endif
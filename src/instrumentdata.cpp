@@ -9,6 +9,8 @@
 #include "synth/oscillator.h"
 #include "synth/sampler.h"
 #include "riffwriter.h"
+#include "binaryio.h"
+#include "eventpool.h"
 #include <sstream>
 #include <cmath>
 
@@ -74,14 +76,51 @@ protected:
 };
 */
 
+// Checks the pointers an instrument record depends on.
+static bool checkInstrument(const ROMFile* rom, uint32_t addr, uint8_t normType, bool isSplit)
+{
+  uint32_t sampleAddr, sampleLen, tableAddr;
+  switch (normType) {
+    case MpInstrument::GBSample:
+      return rom->tryReadPointer(addr + 4) != ROMFile::BAD_PTR;
+    case MpInstrument::Sample:
+    case MpInstrument::FixedSample:
+      sampleAddr = rom->tryReadPointer(addr + 4);
+      if (sampleAddr == ROMFile::BAD_PTR || !rom->tryRead(sampleAddr + 12, sampleLen)) {
+        return false;
+      }
+      return uint64_t(sampleAddr) + 16 + sampleLen <= rom->rom.size();
+    case MpInstrument::KeySplit:
+      if (isSplit) {
+        return true;
+      }
+      tableAddr = rom->tryReadPointer(addr + 8);
+      if (tableAddr == ROMFile::BAD_PTR || tableAddr + 128 > rom->rom.size()) {
+        return false;
+      }
+      // fallthrough
+    case MpInstrument::Percussion:
+      return isSplit || rom->tryReadPointer(addr + 4) != ROMFile::BAD_PTR;
+    default:
+      return true;
+  }
+}
+
 MpInstrument* MpInstrument::load(const ROMFile* rom, uint32_t addr, bool isSplit)
 {
   if (addr == 0x80808080) {
     return nullptr;
   }
-  uint8_t type = rom->read<uint8_t>(addr);
+  // Key splits and garbage pointers lead here often, so reject records that
+  // can't be read without going through an exception.
+  uint8_t type;
+  uint64_t head;
+  uint32_t tail;
+  if (!rom->tryRead(addr, type) || !rom->tryRead(addr, head) || !rom->tryRead(addr + 8, tail)) {
+    return nullptr;
+  }
   if (type == Square1) {
-    if (rom->read<uint64_t>(addr) == 0x0000000200003c01ULL && rom->read<uint32_t>(addr + 8) == 0x000f0000) {
+    if (head == 0x0000000200003c01ULL && tail == 0x000f0000) {
       // unused instrument
       return nullptr;
     }
@@ -91,6 +130,9 @@ MpInstrument* MpInstrument::load(const ROMFile* rom, uint32_t addr, bool isSplit
   if (normType < 0x10) {
     normType &= 0x7;
   }
+  if (!checkInstrument(rom, addr, normType, isSplit)) {
+    return nullptr;
+  }
   try {
     switch (normType) {
       case GBSample:
@@ -119,8 +161,43 @@ MpInstrument* MpInstrument::load(const ROMFile* rom, uint32_t addr, bool isSplit
   }
 }
 
+MpInstrument* MpInstrument::read(const ROMFile* rom, BinaryReader& reader)
+{
+  uint8_t type = 0;
+  if (!reader.read(type)) {
+    return nullptr;
+  }
+  std::unique_ptr<MpInstrument> inst;
+  try {
+    switch (type) {
+      case GBSample:
+      case Sample:
+      case FixedSample:
+        inst.reset(new SampleInstrument(rom, Type(type), reader));
+        break;
+      case Square1:
+      case Square2:
+      case Noise:
+        inst.reset(new PSGInstrument(rom, Type(type), reader));
+        break;
+      case KeySplit:
+      case Percussion:
+        inst.reset(new SplitInstrument(rom, Type(type), reader));
+        break;
+      default:
+        return nullptr;
+    }
+  } catch (std::exception& e) {
+    return nullptr;
+  }
+  if (!reader.ok()) {
+    return nullptr;
+  }
+  return inst.release();
+}
+
 MpInstrument::MpInstrument(const ROMFile* rom, uint32_t addr)
-: rom(rom), addr(addr), type(Type(rom->read<uint8_t>(addr))), forcePan(false), pan(0), gate(0)
+: rom(rom), addr(addr), type(Type(rom->read<uint8_t>(addr))), attack(0), decay(0), sustain(0), release(0), forcePan(false), pan(0), gate(0)
 {
   if (type & 0x7) {
     type = Type(type & 0x7);
@@ -137,6 +214,58 @@ MpInstrument::MpInstrument(const ROMFile* rom, uint32_t addr)
   }
 }
 
+MpInstrument::MpInstrument(const ROMFile* rom, Type type, BinaryReader& reader)
+: rom(rom), addr(0), type(type), attack(0), decay(0), sustain(0), release(0), forcePan(false), pan(0), gate(0)
+{
+  uint8_t flag = 0;
+  reader.read(addr);
+  reader.read(attack);
+  reader.read(decay);
+  reader.read(sustain);
+  reader.read(release);
+  reader.read(gate);
+  reader.read(flag);
+  reader.read(pan);
+  forcePan = flag;
+}
+
+void MpInstrument::write(BinaryWriter& writer) const
+{
+  writer.write<uint8_t>(type);
+  writer.write<uint32_t>(addr);
+  writer.write(attack);
+  writer.write(decay);
+  writer.write(sustain);
+  writer.write(release);
+  writer.write(gate);
+  writer.write<uint8_t>(forcePan);
+  writer.write<uint8_t>(pan);
+}
+
+void SampleInstrument::write(BinaryWriter& writer) const
+{
+  MpInstrument::write(writer);
+  writer.write<uint64_t>(sample->sampleID);
+}
+
+void PSGInstrument::write(BinaryWriter& writer) const
+{
+  MpInstrument::write(writer);
+  writer.write<uint8_t>(mode);
+  writer.write<uint8_t>(sweep);
+}
+
+void SplitInstrument::write(BinaryWriter& writer) const
+{
+  MpInstrument::write(writer);
+  for (const auto& split : splits) {
+    writer.write<uint8_t>(bool(split));
+    if (split) {
+      split->write(writer);
+    }
+  }
+}
+
 Channel::Note* MpInstrument::addEnvelope(Channel* channel, Channel::Note* note, double factor) const
 {
   double startGain = 1.0;
@@ -200,56 +329,80 @@ SampleInstrument::SampleInstrument(const ROMFile* rom, uint32_t addr)
 : MpInstrument(rom, addr)
 {
   uint32_t sampleAddr = rom->readPointer(addr + 4);
-  uint32_t sampleStart = sampleAddr;
   uint64_t sampleID = (uint64_t(type) << 32) | sampleAddr;
   sample = rom->context()->getSample(sampleID);
   if (!sample) {
-    int sampleBits = 4;
-    int sampleLen = 16;
-    int loopStart = 0;
-    int loopEnd = 32;
-    double sampleRate = rom->sampleRate;
-    if (type == GBSample) {
-      sampleRate = 4186.0;
-    } else {
+    if (type != GBSample) {
       pan = rom->read<uint32_t>(addr + 3) ^ 0x80;
       forcePan = !(pan & 0x80);
       if (pan == 127) {
         // adjust full right panning to make centering easier
         pan = 128;
       }
-      sampleBits = 8;
-      sampleLen = rom->read<uint32_t>(sampleAddr + 12);
-      if (rom->read<uint16_t>(sampleAddr + 2)) {
-        loopStart = rom->read<uint32_t>(sampleAddr + 8);
-        loopEnd = sampleLen;
-      } else {
-        loopEnd = 0;
-      }
-      if (type == Sample) {
-        sampleRate = rom->read<uint32_t>(sampleAddr + 4) / 1024.0;
-      }
-      sampleStart = sampleAddr + 16;
-    }
-    if (sampleStart + sampleLen > rom->rom.size()) {
-      throw ROMFile::BadAccess(sampleStart + sampleLen);
     }
-    sample = PcmCodec(rom->context(), type == GBSample ? 4 : 8).decodeRange(rom->rom.begin() + sampleStart, rom->rom.begin() + sampleStart + sampleLen, sampleID);
-    sample->sampleRate = sampleRate;
-    sample->loopStart = loopStart;
-    sample->loopEnd = loopEnd;
+    sample = loadSample(rom, sampleID);
+  }
+}
 
-    /*
-    std::ostringstream fnss;
-    fnss << "dump/sample-" << std::hex << (sampleAddr) << ".wav";
-    RiffWriter dump(sampleRate, false);
-    dump.open(fnss.str());
-    dump.write(sample->channels[0]);
-    dump.close();
-    */
+SampleInstrument::SampleInstrument(const ROMFile* rom, Type type, BinaryReader& reader)
+: MpInstrument(rom, type, reader), sample(nullptr)
+{
+  uint64_t sampleID = 0;
+  if (reader.read(sampleID)) {
+    sample = loadSample(rom, sampleID);
   }
 }
 
+SampleData* SampleInstrument::loadSample(const ROMFile* rom, uint64_t sampleID)
+{
+  SampleData* sample = rom->context()->getSample(sampleID);
+  if (sample) {
+    return sample;
+  }
+  Type type = Type(sampleID >> 32);
+  uint32_t sampleAddr = sampleID & 0xFFFFFFFF;
+  uint32_t sampleStart = sampleAddr;
+  int sampleLen = 16;
+  int loopStart = 0;
+  int loopEnd = 32;
+  double sampleRate = rom->sampleRate;
+  if (type == GBSample) {
+    sampleRate = 4186.0;
+  } else {
+    sampleLen = rom->read<uint32_t>(sampleAddr + 12);
+    if (rom->read<uint16_t>(sampleAddr + 2)) {
+      loopStart = rom->read<uint32_t>(sampleAddr + 8);
+      loopEnd = sampleLen;
+    } else {
+      loopEnd = 0;
+    }
+    if (type == Sample) {
+      sampleRate = rom->read<uint32_t>(sampleAddr + 4) / 1024.0;
+    }
+    sampleStart = sampleAddr + 16;
+  }
+  if (sampleStart + sampleLen > rom->rom.size()) {
+    throw ROMFile::BadAccess(sampleStart + sampleLen);
+  }
+  // The codec consumes vector iterators, so stage just this sample's bytes
+  // instead of keeping a copy of the whole image around.
+  std::vector<uint8_t> pcm(rom->rom.begin() + sampleStart, rom->rom.begin() + sampleStart + sampleLen);
+  sample = PcmCodec(rom->context(), type == GBSample ? 4 : 8).decodeRange(pcm.begin(), pcm.end(), sampleID);
+  sample->sampleRate = sampleRate;
+  sample->loopStart = loopStart;
+  sample->loopEnd = loopEnd;
+
+  /*
+  std::ostringstream fnss;
+  fnss << "dump/sample-" << std::hex << (sampleAddr) << ".wav";
+  RiffWriter dump(sampleRate, false);
+  dump.open(fnss.str());
+  dump.write(sample->channels[0]);
+  dump.close();
+  */
+  return sample;
+}
+
 std::string SampleInstrument::displayName() const
 {
   std::ostringstream ss;
@@ -263,10 +416,10 @@ std::string SampleInstrument::displayName() const
   return ss.str();
 }
 
-BaseNoteEvent* SampleInstrument::makeEvent(double, uint8_t key, uint8_t vel, double len) const
+std::shared_ptr<BaseNoteEvent> SampleInstrument::makeEvent(const std::shared_ptr<EventPool>& pool, double, uint8_t key, uint8_t vel, double len) const
 {
   if (key & 0x80) return nullptr;
-  InstrumentNoteEvent* event = new InstrumentNoteEvent;
+  std::shared_ptr<InstrumentNoteEvent> event = makePooled<InstrumentNoteEvent>(pool);
   event->duration = len;
   event->pitch = key;
   // TODO: velocity accuracy
@@ -311,6 +464,13 @@ PSGInstrument::PSGInstrument(const ROMFile* rom, uint32_t addr)
   }
 }
 
+PSGInstrument::PSGInstrument(const ROMFile* rom, Type type, BinaryReader& reader)
+: MpInstrument(rom, type, reader), mode(0), sweep(0)
+{
+  reader.read(mode);
+  reader.read(sweep);
+}
+
 std::string PSGInstrument::displayName() const
 {
   std::ostringstream ss;
@@ -333,9 +493,9 @@ std::string PSGInstrument::displayName() const
   return ss.str();
 }
 
-BaseNoteEvent* PSGInstrument::makeEvent(double volume, uint8_t key, uint8_t vel, double len) const
+std::shared_ptr<BaseNoteEvent> PSGInstrument::makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const
 {
-  InstrumentNoteEvent* event = new InstrumentNoteEvent;
+  std::shared_ptr<InstrumentNoteEvent> event = makePooled<InstrumentNoteEvent>(pool);
   event->duration = (gate && len > gate) ? gate : len;
   event->pitch = key;
   event->volume = (vel / 127.0);
@@ -420,6 +580,19 @@ SplitInstrument::SplitInstrument(const ROMFile* rom, uint32_t addr)
   }
 }
 
+SplitInstrument::SplitInstrument(const ROMFile* rom, Type type, BinaryReader& reader)
+: MpInstrument(rom, type, reader)
+{
+  for (int i = 0; i < 128 && reader.ok(); i++) {
+    uint8_t present = 0;
+    reader.read(present);
+    splits.emplace_back(present ? read(rom, reader) : nullptr);
+    if (present && !splits.back()) {
+      throw std::runtime_error("invalid split instrument");
+    }
+  }
+}
+
 std::string SplitInstrument::displayName() const
 {
   std::ostringstream ss;
@@ -432,7 +605,7 @@ std::string SplitInstrument::displayName() const
   return ss.str();
 }
 
-BaseNoteEvent* SplitInstrument::makeEvent(double volume, uint8_t key, uint8_t vel, double len) const
+std::shared_ptr<BaseNoteEvent> SplitInstrument::makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const
 {
   auto split = splits.at(key).get();
   if (!split) {
@@ -444,8 +617,8 @@ BaseNoteEvent* SplitInstrument::makeEvent(double volume, uint8_t key, uint8_t ve
       key = baseKey;
     }
   }
-  BaseNoteEvent* event = split->makeEvent(volume, key, vel, len);
-  if (split->forcePan && split->pan != 64) {
+  std::shared_ptr<BaseNoteEvent> event = split->makeEvent(pool, volume, key, vel, len);
+  if (event && split->forcePan && split->pan != 64) {
     event->pan = split->pan;
   }
   return event;
@@ -492,6 +665,13 @@ InstrumentData::InstrumentData(const ROMFile* rom, uint32_t addr)
   }
 }
 
+InstrumentData::InstrumentData(const uint32_t (&table)[128])
+{
+  for (int i = 0; i < 128; i++) {
+    instruments[i] = table[i];
+  }
+}
+
 MpInstrument* InstrumentData::findDupe(SynthContext* synth, const MpInstrument& inst) const
 {
   if (!synth) {
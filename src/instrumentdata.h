@@ -10,10 +10,15 @@ class ROMFile;
 class SampleData;
 struct BaseNoteEvent;
 class SynthContext;
+class BinaryReader;
+class BinaryWriter;
+class EventPool;
 
 class MpInstrument: public IInstrument {
 public:
   static MpInstrument* load(const ROMFile* rom, uint32_t addr, bool isSplit = false);
+  // Recreates an instrument saved with write(). Returns nullptr if the data is invalid.
+  static MpInstrument* read(const ROMFile* rom, BinaryReader& reader);
   MpInstrument(const ROMFile* rom, uint32_t addr);
   virtual ~MpInstrument() {}
 
@@ -36,27 +41,35 @@ public:
   bool forcePan;
   uint8_t pan;
   double gate;
-  virtual BaseNoteEvent* makeEvent(double volume, uint8_t key, uint8_t vel, double len) const = 0;
+  virtual std::shared_ptr<BaseNoteEvent> makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const = 0;
   virtual Channel::Note* noteEvent(Channel* channel, std::shared_ptr<BaseNoteEvent> event) = 0;
 
   inline bool operator==(const MpInstrument& other) const { return *this == &other; }
   bool operator==(const MpInstrument* other) const;
 
   virtual void showParsed(std::ostream& out, std::string indent = std::string()) const;
+  virtual void write(BinaryWriter& writer) const;
 
 protected:
+  MpInstrument(const ROMFile* rom, Type type, BinaryReader& reader);
   Channel::Note* addEnvelope(Channel* channel, Channel::Note* event, double factor) const;
 };
 
 class SampleInstrument : public MpInstrument {
 public:
   SampleInstrument(const ROMFile* rom, uint32_t addr);
+  SampleInstrument(const ROMFile* rom, Type type, BinaryReader& reader);
 
   SampleData* sample;
 
-  virtual BaseNoteEvent* makeEvent(double volume, uint8_t key, uint8_t vel, double len) const;
+  virtual std::shared_ptr<BaseNoteEvent> makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const;
   virtual Channel::Note* noteEvent(Channel* channel, std::shared_ptr<BaseNoteEvent> event);
   virtual std::string displayName() const;
+  virtual void write(BinaryWriter& writer) const;
+
+private:
+  // Returns the sample from the context, decoding it from the ROM if needed.
+  static SampleData* loadSample(const ROMFile* rom, uint64_t sampleID);
 
   //virtual void showParsed(std::ostream& out, std::string indent = std::string()) const;
 };
@@ -64,12 +77,14 @@ public:
 class PSGInstrument : public MpInstrument {
 public:
   PSGInstrument(const ROMFile* rom, uint32_t addr);
+  PSGInstrument(const ROMFile* rom, Type type, BinaryReader& reader);
 
   uint8_t mode, sweep;
 
-  virtual BaseNoteEvent* makeEvent(double volume, uint8_t key, uint8_t vel, double len) const;
+  virtual std::shared_ptr<BaseNoteEvent> makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const;
   virtual Channel::Note* noteEvent(Channel* channel, std::shared_ptr<BaseNoteEvent> event);
   virtual std::string displayName() const;
+  virtual void write(BinaryWriter& writer) const;
 
   //virtual void showParsed(std::ostream& out, std::string indent = std::string()) const;
 };
@@ -77,12 +92,14 @@ public:
 class SplitInstrument : public MpInstrument {
 public:
   SplitInstrument(const ROMFile* rom, uint32_t addr);
+  SplitInstrument(const ROMFile* rom, Type type, BinaryReader& reader);
 
   std::vector<std::shared_ptr<MpInstrument>> splits;
 
-  virtual BaseNoteEvent* makeEvent(double volume, uint8_t key, uint8_t vel, double len) const;
+  virtual std::shared_ptr<BaseNoteEvent> makeEvent(const std::shared_ptr<EventPool>& pool, double volume, uint8_t key, uint8_t vel, double len) const;
   virtual Channel::Note* noteEvent(Channel* channel, std::shared_ptr<BaseNoteEvent> event);
   virtual std::string displayName() const;
+  virtual void write(BinaryWriter& writer) const;
 
   virtual void showParsed(std::ostream& out, std::string indent = std::string()) const;
 };
@@ -90,6 +107,8 @@ public:
 class InstrumentData {
 public:
   InstrumentData(const ROMFile* rom, uint32_t addr);
+  // Uses instruments that are already registered with the synth context.
+  InstrumentData(const uint32_t (&table)[128]);
 
   uint32_t instruments[128];
 
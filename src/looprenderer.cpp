@@ -0,0 +1,94 @@
+#include "looprenderer.h"
+#include "songdata.h"
+#include "synth/synthcontext.h"
+#include "riffwriter.h"
+#include <cmath>
+
+// Stereo 16-bit output
+static const size_t FRAME_SIZE = 4;
+static const size_t CHUNK_FRAMES = 16384;
+
+LoopRenderer::LoopRenderer(SynthContext* synth, SongData* song)
+: reusedPasses(0), synth(synth), song(song)
+{
+  // initializers only
+}
+
+size_t LoopRenderer::frameAt(double time) const
+{
+  return size_t(std::llround(time * synth->sampleRate));
+}
+
+void LoopRenderer::synthesize(size_t frames, std::vector<int16_t>& samples)
+{
+  samples.assign(frames * 2, 0);
+  uint8_t* buffer = reinterpret_cast<uint8_t*>(samples.data());
+  size_t done = 0;
+  while (done < frames) {
+    size_t chunk = frames - done < CHUNK_FRAMES ? frames - done : CHUNK_FRAMES;
+    int written = synth->fillBuffer(buffer + done * FRAME_SIZE, chunk * FRAME_SIZE);
+    if (written <= 0) {
+      // The song ended early; the rest stays silent.
+      break;
+    }
+    done += written / FRAME_SIZE;
+  }
+}
+
+void LoopRenderer::save(RiffWriter* riff)
+{
+  reusedPasses = 0;
+  int passes = song->loopCount > 0 ? song->loopCount : 1;
+  std::vector<int16_t> samples, body;
+  size_t pos = frameAt(song->loopEndTime(0));
+  synthesize(pos, samples);
+  riff->write(samples);
+
+  // Synthesize until a pass is known to repeat.
+  int pass = 1;
+  for (; pass < passes && body.empty(); pass++) {
+    size_t end = frameAt(song->loopEndTime(pass));
+    synthesize(end - pos, samples);
+    riff->write(samples);
+    pos = end;
+    if (pass >= 2 && song->loopStateRepeats(pass - 2, pass - 1) && !samples.empty()) {
+      body.swap(samples);
+    }
+  }
+
+  size_t fadeFrames = frameAt(song->fadeTime);
+  if (body.empty()) {
+    synthesize(fadeFrames, samples);
+  } else {
+    // Later passes, and the fade, come from the saved pass. Its length is
+    // rounded to whole frames, so it's treated as one continuous cycle.
+    size_t bodyFrames = body.size() / 2;
+    size_t end = frameAt(song->loopEndTime(passes - 1));
+    size_t cursor = 0;
+    reusedPasses = passes - pass;
+    auto copyBody = [&](size_t frames, std::vector<int16_t>& out) {
+      out.resize(frames * 2);
+      for (size_t i = 0; i < frames; i++) {
+        out[i * 2] = body[cursor * 2];
+        out[i * 2 + 1] = body[cursor * 2 + 1];
+        if (++cursor == bodyFrames) {
+          cursor = 0;
+        }
+      }
+    };
+    while (pos < end) {
+      size_t chunk = end - pos < CHUNK_FRAMES ? end - pos : CHUNK_FRAMES;
+      copyBody(chunk, samples);
+      riff->write(samples);
+      pos += chunk;
+    }
+    copyBody(fadeFrames, samples);
+  }
+
+  for (size_t i = 0; i < fadeFrames; i++) {
+    double gain = 1.0 - double(i) / fadeFrames;
+    samples[i * 2] = int16_t(samples[i * 2] * gain);
+    samples[i * 2 + 1] = int16_t(samples[i * 2 + 1] * gain);
+  }
+  riff->write(samples);
+}
@@ -0,0 +1,32 @@
+#ifndef GBAMP2WAV_LOOPRENDERER_H
+#define GBAMP2WAV_LOOPRENDERER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+class SynthContext;
+class SongData;
+class RiffWriter;
+
+// Renders a song that has been set to loop (see SongData::setLoops()), fading
+// out after the last pass. Once the sequencer state at two consecutive loop
+// points matches, every later pass sounds the same, so the last synthesized
+// pass is kept and written out again instead of being synthesized.
+class LoopRenderer {
+public:
+  LoopRenderer(SynthContext* synth, SongData* song);
+
+  void save(RiffWriter* riff);
+
+  // The number of passes that were copied instead of synthesized.
+  int reusedPasses;
+
+private:
+  void synthesize(size_t frames, std::vector<int16_t>& samples);
+  size_t frameAt(double time) const;
+
+  SynthContext* synth;
+  SongData* song;
+};
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef GBAMP2WAV_LRUCACHE_H
+#define GBAMP2WAV_LRUCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+
+// Thread-safe map holding at most `capacity` entries. When it's full, the
+// least recently used entry is discarded to make room. If several threads ask
+// getOrCompute() for the same missing key at once, only one of them computes
+// it and the rest wait for its result.
+template<typename K, typename V>
+class LRUCache {
+public:
+  struct Stats {
+    uint64_t hits, misses, evictions;
+  };
+
+  LRUCache(size_t capacity) : capacity(capacity ? capacity : 1), counters{ 0, 0, 0 } {}
+  LRUCache(const LRUCache& other) = delete;
+  LRUCache& operator=(const LRUCache& other) = delete;
+
+  bool get(const K& key, V& value)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!findLocked(key, value)) {
+      ++counters.misses;
+      return false;
+    }
+    ++counters.hits;
+    return true;
+  }
+
+  void put(const K& key, const V& value)
+  {
+    // Evicted values are destroyed after the lock is released.
+    std::vector<V> evicted;
+    std::lock_guard<std::mutex> guard(lock);
+    insertLocked(key, value, evicted);
+  }
+
+  // Removes the entry for `key`, returning its value. Returns false if there
+  // isn't one.
+  bool take(const K& key, V& value)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = index.find(key);
+    if (iter == index.end()) {
+      return false;
+    }
+    value = std::move(iter->second->second);
+    entries.erase(iter->second);
+    index.erase(iter);
+    return true;
+  }
+
+  // Returns the cached value for `key`, calling compute() to fill it in if
+  // necessary. An exception thrown by compute() is passed on to every thread
+  // waiting for it, and nothing is cached.
+  V getOrCompute(const K& key, const std::function<V()>& compute)
+  {
+    std::shared_ptr<Pending> pending;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      V value;
+      if (findLocked(key, value)) {
+        ++counters.hits;
+        return value;
+      }
+      auto iter = inFlight.find(key);
+      if (iter != inFlight.end()) {
+        // Another thread is already computing it.
+        ++counters.hits;
+        pending = iter->second;
+        finished.wait(guard, [&pending]{ return pending->done; });
+        if (pending->error) {
+          std::rethrow_exception(pending->error);
+        }
+        return pending->value;
+      }
+      ++counters.misses;
+      pending = std::make_shared<Pending>();
+      inFlight[key] = pending;
+    }
+
+    V value;
+    std::exception_ptr error;
+    try {
+      value = compute();
+    } catch (...) {
+      error = std::current_exception();
+    }
+    std::vector<V> evicted;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      inFlight.erase(key);
+      pending->done = true;
+      pending->value = value;
+      pending->error = error;
+      if (!error) {
+        insertLocked(key, value, evicted);
+      }
+    }
+    finished.notify_all();
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    return value;
+  }
+
+  Stats stats() const
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return counters;
+  }
+
+private:
+  struct Pending {
+    bool done = false;
+    V value;
+    std::exception_ptr error;
+  };
+  typedef std::list<std::pair<K, V>> EntryList;
+
+  bool findLocked(const K& key, V& value)
+  {
+    auto iter = index.find(key);
+    if (iter == index.end()) {
+      return false;
+    }
+    // Move it to the front of the list
+    entries.splice(entries.begin(), entries, iter->second);
+    value = iter->second->second;
+    return true;
+  }
+
+  void insertLocked(const K& key, const V& value, std::vector<V>& evicted)
+  {
+    auto iter = index.find(key);
+    if (iter != index.end()) {
+      iter->second->second = value;
+      entries.splice(entries.begin(), entries, iter->second);
+      return;
+    }
+    entries.emplace_front(key, value);
+    index[key] = entries.begin();
+    while (entries.size() > capacity) {
+      evicted.push_back(std::move(entries.back().second));
+      index.erase(entries.back().first);
+      entries.pop_back();
+      ++counters.evictions;
+    }
+  }
+
+  const size_t capacity;
+  mutable std::mutex lock;
+  std::condition_variable finished;
+  EntryList entries;
+  std::unordered_map<K, typename EntryList::iterator> index;
+  std::unordered_map<K, std::shared_ptr<Pending>> inFlight;
+  Stats counters;
+};
+
+#endif
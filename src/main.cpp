@@ -1,20 +1,121 @@
 #include "romfile.h"
 #include "songtable.h"
 #include "songdata.h"
+#include "romscanner.h"
+#include "scancache.h"
+#include "compiledsong.h"
+#include "looprenderer.h"
+#include "trace.h"
+#include "gameprofile.h"
 #include "instrumentdata.h"
 #include "utility.h"
 #include "clefcontext.h"
 #include "synth/synthcontext.h"
 #include "riffwriter.h"
 #include "commandargs.h"
+#include "seq/itrack.h"
 #include <iostream>
 #include <iomanip>
 #include <fstream>
 #include <memory>
 #include <algorithm>
+#include <unordered_set>
 #include <cstdlib>
 #include <sstream>
 
+// Plays a track from the point its song was sought to, shifted so that the
+// synth sees that point as time 0.
+class SeekedTrack : public ITrack {
+public:
+  SeekedTrack(TrackData* track, double start) : track(track), start(start)
+  {
+    // initializers only
+  }
+
+  virtual bool isFinished() const { return track->isFinished(); }
+  virtual double length() const { return std::max(0.0, track->length() - start); }
+
+protected:
+  virtual std::shared_ptr<SequenceEvent> readNextEvent()
+  {
+    std::shared_ptr<SequenceEvent> event = track->nextEvent();
+    if (event) {
+      event->timestamp -= start;
+    }
+    return event;
+  }
+
+  virtual void internalReset()
+  {
+    // PSG channels are shared, so the whole song has to seek together.
+    track->song->seekTo(start);
+  }
+
+private:
+  TrackData* track;
+  double start;
+};
+
+static ScanCache::SongStatus errorStatus(std::exception_ptr error)
+{
+  ScanCache::SongStatus status;
+  status.numTracks = -1;
+  try {
+    std::rethrow_exception(error);
+  } catch (std::exception& e) {
+    status.error = e.what();
+  } catch (...) {
+    status.error = "unknown error";
+  }
+  return status;
+}
+
+static std::vector<ScanCache::SongStatus> songStatuses(const ROMFile& rom, const SongTable& st, const std::vector<uint32_t>& songs, bool validate)
+{
+  // Only decoding the tracks is expensive enough to be worth caching.
+  ScanCache* cache = validate ? rom.scanCache() : nullptr;
+  std::vector<ScanCache::SongStatus> statuses(songs.size());
+  std::vector<bool> cached(songs.size(), false);
+  std::vector<std::unique_ptr<SongData>> loaded(songs.size());
+  std::vector<const SongData*> toDecode;
+  std::vector<size_t> decodeIndex;
+  for (size_t i = 0; i < songs.size(); i++) {
+    if (cache && cache->songStatus(songs[i], statuses[i])) {
+      cached[i] = true;
+      continue;
+    }
+    // Loading registers instruments, so it stays on this thread.
+    try {
+      loaded[i].reset(st.songAt(songs[i]));
+      statuses[i].numTracks = loaded[i]->numTracks();
+    } catch (...) {
+      statuses[i] = errorStatus(std::current_exception());
+      continue;
+    }
+    if (validate) {
+      toDecode.push_back(loaded[i].get());
+      decodeIndex.push_back(i);
+    }
+  }
+
+  std::vector<std::exception_ptr> errors;
+  SongData::decodeSongs(toDecode, errors);
+  for (size_t i = 0; i < errors.size(); i++) {
+    if (errors[i]) {
+      statuses[decodeIndex[i]] = errorStatus(errors[i]);
+    }
+  }
+
+  if (cache) {
+    for (size_t i = 0; i < songs.size(); i++) {
+      if (!cached[i]) {
+        cache->setSongStatus(songs[i], statuses[i]);
+      }
+    }
+  }
+  return statuses;
+}
+
 static int scanSongTables(const ROMFile& rom, bool doValidate)
 {
   std::vector<SongTable> sts = rom.findSongTables();
@@ -23,29 +124,50 @@ static int scanSongTables(const ROMFile& rom, bool doValidate)
     return 1;
   }
 
-  for (const auto& st : rom.findSongTables()) {
-    std::cerr << "Song table @ 0x" << std::hex << st.tableStart << std::dec << ": " << st.songs.size() << " songs (table size " << ((st.tableEnd - st.tableStart) / 8) << ")" << std::endl;
+  if (rom.profile) {
+    std::cerr << "Game profile " << rom.gameCode << " rev " << rom.revision;
+    if (!rom.profile->title.empty()) {
+      std::cerr << " (" << rom.profile->title << ")";
+    }
+    std::cerr << ": song table @ 0x" << std::hex << rom.profile->songTable << std::dec << std::endl;
+  }
+  const SoundEngine& engine = rom.engine;
+  if (engine.selectSongAddr) {
+    std::cerr << "Sound engine @ 0x" << std::hex << engine.selectSongAddr << ": song table @ 0x" << engine.songTableAddr << std::dec;
+    if (engine.soundModeAddr) {
+      std::cerr << ", " << engine.sampleRate << " Hz, " << engine.maxChannels << " channels";
+    }
+    std::cerr << std::endl;
+  }
+
+  for (const auto& st : sts) {
+    std::unordered_set<uint32_t> valid(st.songs.begin(), st.songs.end());
+    std::vector<int> indexes;
+    std::vector<uint32_t> songs;
     for (uint32_t addr = st.tableStart; addr < st.tableEnd; addr += 8) {
       uint32_t song = rom.readPointer(addr);
-      if (!doValidate && std::find(st.songs.begin(), st.songs.end(), song) == st.songs.end()) {
-        continue;
+      if (doValidate || valid.count(song)) {
+        indexes.push_back((addr - st.tableStart) / 8);
+        songs.push_back(song);
       }
-      int idx = (addr - st.tableStart) / 8;
-      std::cerr << "\t" << std::setfill(' ') << std::setw(4) << idx << " Song @ 0x" << std::hex << std::setw(8) << std::setfill('0') << song << std::dec << " - ";
-      try {
-        std::unique_ptr<SongData> sd(st.songAt(song));
-        std::cerr << sd->numTracks() << " tracks" << std::endl;
-      } catch (std::exception& e) {
-        std::cerr << e.what() << std::endl;
-      } catch (...) {
-        std::cerr << "unknown error" << std::endl;
+    }
+    std::vector<ScanCache::SongStatus> statuses = songStatuses(rom, st, songs, doValidate);
+
+    std::cerr << "Song table @ 0x" << std::hex << st.tableStart << std::dec << ": " << st.songs.size() << " songs (table size " << ((st.tableEnd - st.tableStart) / 8) << ")" << std::endl;
+    for (size_t i = 0; i < songs.size(); i++) {
+      std::cerr << "\t" << std::setfill(' ') << std::setw(4) << indexes[i] << " Song @ 0x" << std::hex << std::setw(8) << std::setfill('0') << songs[i] << std::dec << " - ";
+      const ScanCache::SongStatus& status = statuses[i];
+      if (status.numTracks < 0) {
+        std::cerr << status.error << std::endl;
+      } else {
+        std::cerr << status.numTracks << " tracks" << std::endl;
       }
     }
   }
   return 0;
 }
 
-static int scanAllSongs(const ROMFile& rom)
+static int scanAllSongs(const ROMFile& rom, bool doValidate)
 {
   SongTable st = rom.findAllSongs();
   if (st.songs.empty()) {
@@ -53,9 +175,15 @@ static int scanAllSongs(const ROMFile& rom)
     return 1;
   }
 
-  for (uint32_t song : st.songs) {
-    std::unique_ptr<SongData> sd(st.songAt(song));
-    std::cerr << "Song @ 0x" << std::hex << song << std::dec << " - " << sd->numTracks() << " tracks" << std::endl;
+  std::vector<ScanCache::SongStatus> statuses = songStatuses(rom, st, st.songs, doValidate);
+  for (size_t i = 0; i < st.songs.size(); i++) {
+    const ScanCache::SongStatus& status = statuses[i];
+    std::cerr << "Song @ 0x" << std::hex << st.songs[i] << std::dec << " - ";
+    if (status.numTracks < 0) {
+      std::cerr << status.error << std::endl;
+    } else {
+      std::cerr << status.numTracks << " tracks" << std::endl;
+    }
     std::cerr << std::endl;
   }
   return 0;
@@ -69,13 +197,21 @@ int main(int argc, char** argv)
     { "scan", "s", "", "Scan for song tables" },
     { "scan-songs", "S", "", "Scan for songs, even without tables" },
     { "validate", "V", "", "Validate songs when scanning" },
+    { "bench-scan", "", "", "Time the scanner's pointer prefilter against checking every word" },
     { "table", "t", "location", "Use a specific song table" },
     { "parse", "p", "", "Output parsed sequence data instead of audio" },
     { "instruments", "i", "", "Output parsed instrument data instead of audio" },
     { "multiboot", "m", "", "Treat the input file as a multiboot image instead of a ROM" },
+    { "no-cache", "", "", "Don't read or write the persistent scan cache" },
+    { "compile", "", "filename", "Save the decoded song to a compiled song file instead of audio" },
+    { "compiled", "", "filename", "Load the song from a compiled song file instead of the ROM's song tables" },
     { "mute", "", "channels", "Comma-separated list of channels to mute" },
     { "solo", "", "channels", "Comma-separated list of channels to solo" },
     { "preamp", "", "gain", "Adjust all channel volumes before mixing (default 1.0)" },
+    { "loops", "", "count", "Play the song's loop the given number of times, then fade out" },
+    { "fade", "", "seconds", "Length of the fade out after looping (default 8)" },
+    { "start", "", "seconds", "Start playback at the given time" },
+    { "trace", "", "filename", "Write playback diagnostics in Chrome trace format (requires a TRACE=1 build)" },
     { "", "", "input", "Path to the input file" },
     { "", "", "song", "Song index or sequence offset" },
   });
@@ -96,6 +232,7 @@ int main(int argc, char** argv)
   ClefContext clef;
   SynthContext ctx(&clef, 32768);
   ROMFile rom(&clef);
+  rom.useScanCache = !args.hasKey("no-cache");
   rom.load(&ctx, src, args.hasKey("multiboot"));
 
   if (args.hasKey("scan")) {
@@ -103,19 +240,26 @@ int main(int argc, char** argv)
   }
 
   if (args.hasKey("scan-songs")) {
-    return scanAllSongs(rom);
+    return scanAllSongs(rom, args.hasKey("validate"));
   }
 
-  if (args.positional().size() < 2) {
+  if (args.hasKey("bench-scan")) {
+    return ROMScanner::benchmark(&rom, std::cout) ? 0 : 1;
+  }
+
+  bool compiled = args.hasKey("compiled");
+  if (!compiled && args.positional().size() < 2) {
     std::cerr << args.usageText(argv[0]) << std::endl;
     return 1;
   }
 
-  std::string songSelection = args.positional()[1];
+  std::string songSelection = compiled ? "compiled" : args.positional()[1];
 
   SongTable songTable;
   bool byAddr = songSelection.substr(0, 2) == "0x";
-  if (args.hasKey("table")) {
+  if (compiled) {
+    // The song table isn't needed
+  } else if (args.hasKey("table")) {
     std::string tbl(args.getString("table"));
     uint32_t songTableAddr = 0;
     if (tbl.size() > 2 && tbl[1] == 'x') {
@@ -149,7 +293,9 @@ int main(int argc, char** argv)
 
   std::unique_ptr<SongData> sd;
   try {
-    if (byAddr) {
+    if (compiled) {
+      sd.reset(loadCompiledSong(&rom, args.getString("compiled")));
+    } else if (byAddr) {
       uint32_t addr = 0;
       addr = std::stoi(songSelection, nullptr, 16);
       sd.reset(songTable.songAt(addr));
@@ -162,6 +308,7 @@ int main(int argc, char** argv)
       std::cerr << "Could not load song " << songSelection << std::endl;
       return 1;
     }
+    sd->decodeAll();
   } catch (std::exception& e) {
     std::cerr << "An error occurred while loading song " << songSelection << std::endl;
     std::cerr << "\t" << e.what() << std::endl;
@@ -169,7 +316,13 @@ int main(int argc, char** argv)
   }
 
   std::string filename = args.getString("output");
-  if (args.hasKey("parse")) {
+  if (args.hasKey("compile")) {
+    if (!saveCompiledSong(*sd, args.getString("compile"))) {
+      std::cerr << "Could not write compiled song to \"" << args.getString("compile") << "\"" << std::endl;
+      return 1;
+    }
+    return 0;
+  } else if (args.hasKey("parse")) {
     if (filename.empty()) {
       sd->showParsed(std::cout);
     } else {
@@ -221,16 +374,52 @@ int main(int argc, char** argv)
     }
   }
 
+  if (args.hasKey("trace") && !Trace::isEnabled(Trace::Error)) {
+    std::cerr << "Tracing is not enabled in this build." << std::endl;
+    return 1;
+  }
+
+  bool looping = args.hasKey("loops") && sd->canLoop();
+  if (args.hasKey("loops")) {
+    int loops = args.getInt("loops");
+    double fade = args.hasKey("fade") ? args.getFloat("fade") : 8.0;
+    if (loops < 1 || fade < 0) {
+      std::cerr << "Invalid loop count or fade length" << std::endl;
+      return 1;
+    } else if (!looping) {
+      std::cerr << "Song does not loop; rendering it once" << std::endl;
+    } else {
+      sd->setLoops(loops, fade);
+    }
+  }
+
+  double start = args.hasKey("start") ? args.getFloat("start") : 0;
+  if (start < 0) {
+    std::cerr << "Invalid start time" << std::endl;
+    return 1;
+  } else if (start > 0 && looping) {
+    std::cerr << "Only one of --start and --loops may be specified." << std::endl;
+    return 1;
+  }
 
+  std::vector<std::unique_ptr<SeekedTrack>> seekedTracks;
   for (int i = 0; i < sd->numTracks(); i++) {
     TrackData* td = static_cast<TrackData*>(sd->getTrack(i));
     if (args.hasKey("preamp")) {
       td->preamp = args.getFloat("preamp");
       std::cerr << i << " " << td->preamp << std::endl;
     }
-    ctx.addChannel(td);
+    if (start > 0) {
+      seekedTracks.emplace_back(new SeekedTrack(td, start));
+      ctx.addChannel(seekedTracks.back().get());
+    } else {
+      ctx.addChannel(td);
+    }
     ctx.channels[i]->mute = (mute[i] != solo);
   }
+  if (start > 0) {
+    sd->seekTo(start);
+  }
 
   if (filename.empty()) {
     std::ostringstream fnss;
@@ -240,7 +429,20 @@ int main(int argc, char** argv)
   std::cerr << "Writing " << (int(ctx.maximumTime() * 10) * .1) << " seconds to \"" << filename << "\"..." << std::endl;
   RiffWriter riff(ctx.sampleRate, true);
   riff.open(filename);
-  ctx.save(&riff);
+  if (looping) {
+    LoopRenderer renderer(&ctx, sd.get());
+    renderer.save(&riff);
+    if (renderer.reusedPasses) {
+      std::cerr << "Reused the rendered loop for " << renderer.reusedPasses << " passes" << std::endl;
+    }
+  } else {
+    ctx.save(&riff);
+  }
   riff.close();
+
+  if (args.hasKey("trace")) {
+    std::ofstream traceFile(args.getString("trace"));
+    Trace::dumpChromeTrace(traceFile);
+  }
   return 0;
 }
@@ -0,0 +1,182 @@
+#include "pointermap.h"
+#include "rombuffer.h"
+#include "threadpool.h"
+
+#ifndef MP2K_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MP2K_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MP2K_SIMD_SSE2
+#endif
+#endif
+
+// Number of 64-word blocks handed to a worker at a time
+static const size_t BLOCK_GRAIN = 256;
+
+static inline int lowestBit(uint64_t bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctzll(bits);
+#else
+  int n = 0;
+  while (!(bits & 1)) {
+    bits >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+PointerMap::PointerMap()
+{
+  // initializers only
+}
+
+void PointerMap::build(const ROMBuffer& rom, uint32_t baseAddr, uint32_t headerSize)
+{
+  size_t numWords = rom.size() / 4;
+  size_t numBlocks = (numWords + 63) / 64;
+  pointers.assign(numBlocks, 0);
+  alignedPointers.assign(numBlocks, 0);
+  if (rom.size() < headerSize + 12) {
+    return;
+  }
+  uint32_t maxTarget = rom.size() - 12;
+  ThreadPool::instance()->parallelFor(numBlocks, BLOCK_GRAIN, [&](size_t first, size_t last) {
+    buildBlocks(rom, first, last, baseAddr, headerSize, maxTarget);
+  });
+}
+
+const char* PointerMap::implementation()
+{
+#if defined(MP2K_SIMD_AVX2)
+  return "AVX2";
+#elif defined(MP2K_SIMD_SSE2)
+  return "SSE2";
+#else
+  return "scalar";
+#endif
+}
+
+void PointerMap::buildBlocks(const ROMBuffer& rom, size_t first, size_t last, uint32_t baseAddr, uint32_t minTarget, uint32_t maxTarget)
+{
+  size_t numWords = rom.size() / 4;
+  uint8_t hiByte = baseAddr >> 24;
+  for (size_t block = first; block < last; block++) {
+    size_t word = block * 64;
+    uint64_t any = 0, aligned = 0;
+    int bit = 0;
+    if (word + 64 <= numWords) {
+      // Targets are masked to 25 bits, so signed comparisons are safe.
+#if defined(MP2K_SIMD_AVX2)
+      const __m256i hiMask = _mm256_set1_epi32(0xFE000000);
+      const __m256i loMask = _mm256_set1_epi32(0x01FFFFFF);
+      const __m256i alignMask = _mm256_set1_epi32(3);
+      const __m256i base = _mm256_set1_epi32(baseAddr);
+      const __m256i minV = _mm256_set1_epi32(minTarget);
+      const __m256i maxV = _mm256_set1_epi32(maxTarget);
+      const __m256i zero = _mm256_setzero_si256();
+      const __m256i* src = reinterpret_cast<const __m256i*>(rom.data() + word * 4);
+      for (; bit < 64; bit += 8, src++) {
+        __m256i w = _mm256_loadu_si256(src);
+        __m256i target = _mm256_and_si256(w, loMask);
+        __m256i outOfRange = _mm256_or_si256(_mm256_cmpgt_epi32(minV, target), _mm256_cmpgt_epi32(target, maxV));
+        __m256i ok = _mm256_andnot_si256(outOfRange, _mm256_cmpeq_epi32(_mm256_and_si256(w, hiMask), base));
+        __m256i isAligned = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_and_si256(w, alignMask), zero));
+        any |= uint64_t(uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(ok)))) << bit;
+        aligned |= uint64_t(uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(isAligned)))) << bit;
+      }
+#elif defined(MP2K_SIMD_SSE2)
+      const __m128i hiMask = _mm_set1_epi32(0xFE000000);
+      const __m128i loMask = _mm_set1_epi32(0x01FFFFFF);
+      const __m128i alignMask = _mm_set1_epi32(3);
+      const __m128i base = _mm_set1_epi32(baseAddr);
+      const __m128i minV = _mm_set1_epi32(minTarget);
+      const __m128i maxV = _mm_set1_epi32(maxTarget);
+      const __m128i zero = _mm_setzero_si128();
+      const __m128i* src = reinterpret_cast<const __m128i*>(rom.data() + word * 4);
+      for (; bit < 64; bit += 4, src++) {
+        __m128i w = _mm_loadu_si128(src);
+        __m128i target = _mm_and_si128(w, loMask);
+        __m128i outOfRange = _mm_or_si128(_mm_cmplt_epi32(target, minV), _mm_cmpgt_epi32(target, maxV));
+        __m128i ok = _mm_andnot_si128(outOfRange, _mm_cmpeq_epi32(_mm_and_si128(w, hiMask), base));
+        __m128i isAligned = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_and_si128(w, alignMask), zero));
+        any |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(ok))) << bit;
+        aligned |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(isAligned))) << bit;
+      }
+#endif
+    }
+    // Scalar fallback, also used for the partial block at the end of the image.
+    // Nearly every word fails on its top byte, so check that before reading
+    // the rest of it.
+    const uint8_t* hiBytes = rom.data() + word * 4 + 3;
+    for (; bit < 64 && word + bit < numWords; bit++) {
+      if ((hiBytes[bit * 4] & 0xFE) != hiByte) {
+        continue;
+      }
+      uint32_t w = rom.parseInt<uint32_t>((word + bit) * 4);
+      uint32_t target = w & 0x01FFFFFF;
+      if ((w & 0xFE000000) != baseAddr || target < minTarget || target > maxTarget) {
+        continue;
+      }
+      any |= uint64_t(1) << bit;
+      if (!(w & 3)) {
+        aligned |= uint64_t(1) << bit;
+      }
+    }
+    pointers[block] = any;
+    alignedPointers[block] = aligned;
+  }
+}
+
+bool PointerMap::isPointer(uint32_t offset) const
+{
+  size_t word = offset >> 2;
+  if ((offset & 3) || (word >> 6) >= pointers.size()) {
+    return false;
+  }
+  return (pointers[word >> 6] >> (word & 63)) & 1;
+}
+
+bool PointerMap::isAlignedPointer(uint32_t offset) const
+{
+  size_t word = offset >> 2;
+  if ((offset & 3) || (word >> 6) >= alignedPointers.size()) {
+    return false;
+  }
+  return (alignedPointers[word >> 6] >> (word & 63)) & 1;
+}
+
+uint32_t PointerMap::nextPointer(uint32_t offset, uint32_t end) const
+{
+  return next(pointers, offset, end);
+}
+
+uint32_t PointerMap::nextAlignedPointer(uint32_t offset, uint32_t end) const
+{
+  return next(alignedPointers, offset, end);
+}
+
+uint32_t PointerMap::next(const std::vector<uint64_t>& bits, uint32_t offset, uint32_t end)
+{
+  size_t word = (offset + 3) >> 2;
+  size_t block = word >> 6;
+  if (block >= bits.size()) {
+    return end;
+  }
+  size_t lastBlock = (size_t(end) + 255) >> 8;
+  if (lastBlock > bits.size()) {
+    lastBlock = bits.size();
+  }
+  uint64_t mask = bits[block] & (~uint64_t(0) << (word & 63));
+  while (!mask) {
+    if (++block >= lastBlock) {
+      return end;
+    }
+    mask = bits[block];
+  }
+  uint64_t found = (block * 64 + lowestBit(mask)) * 4;
+  return found < end ? found : end;
+}
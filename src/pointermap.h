@@ -0,0 +1,42 @@
+#ifndef GBAMP2WAV_POINTERMAP_H
+#define GBAMP2WAV_POINTERMAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+class ROMBuffer;
+
+// A bitmap with one bit per 4-byte word of a ROM image, set if the word looks
+// like a pointer that ROMFile::cleanPointer would accept for a 12-byte target.
+// Scans use it to skip offsets that can't possibly hold a song or table entry.
+//
+// Built with SSE2 or AVX2 when the compiler targets them. Define MP2K_NO_SIMD
+// to force the scalar implementation for comparison. The command-line tool's
+// --bench-scan option times it against checking every word.
+class PointerMap {
+public:
+  PointerMap();
+
+  void build(const ROMBuffer& rom, uint32_t baseAddr, uint32_t headerSize);
+  // The instruction set build() uses: "AVX2", "SSE2", or "scalar"
+  static const char* implementation();
+
+  // Any target alignment
+  bool isPointer(uint32_t offset) const;
+  // Target aligned to 4 bytes
+  bool isAlignedPointer(uint32_t offset) const;
+
+  // Returns the first word-aligned offset in [offset, end) that holds a
+  // candidate pointer, or end if there is none.
+  uint32_t nextPointer(uint32_t offset, uint32_t end) const;
+  uint32_t nextAlignedPointer(uint32_t offset, uint32_t end) const;
+
+private:
+  void buildBlocks(const ROMBuffer& rom, size_t first, size_t last, uint32_t baseAddr, uint32_t minTarget, uint32_t maxTarget);
+  static uint32_t next(const std::vector<uint64_t>& bits, uint32_t offset, uint32_t end);
+
+  std::vector<uint64_t> pointers;
+  std::vector<uint64_t> alignedPointers;
+};
+
+#endif
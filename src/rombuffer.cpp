@@ -0,0 +1,198 @@
+#include "rombuffer.h"
+#include "threadpool.h"
+#include <vector>
+#include <mutex>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+struct ROMBuffer::Storage {
+  Storage() : mapped(nullptr), mappedSize(0), hash(0) {}
+  Storage(const Storage& other) = delete;
+  Storage& operator=(const Storage& other) = delete;
+  ~Storage();
+
+  std::vector<uint8_t> buffer;
+  void* mapped;
+  size_t mappedSize;
+
+  mutable std::once_flag hashOnce;
+  mutable uint64_t hash;
+};
+
+ROMBuffer::Storage::~Storage()
+{
+  if (!mapped) {
+    return;
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(mapped);
+#else
+  munmap(mapped, mappedSize);
+#endif
+}
+
+ROMBuffer::ROMBuffer()
+: ptr(nullptr), len(0)
+{
+  // initializers only
+}
+
+ROMBuffer::ROMBuffer(std::shared_ptr<const Storage> storage)
+: storage(storage), ptr(nullptr), len(0)
+{
+  if (storage->mapped) {
+    ptr = reinterpret_cast<const uint8_t*>(storage->mapped);
+    len = storage->mappedSize;
+  } else {
+    ptr = storage->buffer.data();
+    len = storage->buffer.size();
+  }
+}
+
+bool ROMBuffer::isMapped() const
+{
+  return storage && storage->mapped;
+}
+
+ROMBuffer ROMBuffer::map(const std::string& path)
+{
+  std::shared_ptr<Storage> storage(new Storage);
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return ROMBuffer();
+  }
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 || fileSize.QuadPart > 0xFFFFFFFF) {
+    CloseHandle(file);
+    return ROMBuffer();
+  }
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (!mapping) {
+    return ROMBuffer();
+  }
+  // The view keeps the mapping object alive after the handle is closed.
+  storage->mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!storage->mapped) {
+    return ROMBuffer();
+  }
+  storage->mappedSize = fileSize.QuadPart;
+#else
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return ROMBuffer();
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 || st.st_size > 0xFFFFFFFFLL) {
+    close(fd);
+    return ROMBuffer();
+  }
+  void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return ROMBuffer();
+  }
+  storage->mapped = mapped;
+  storage->mappedSize = st.st_size;
+#endif
+  return ROMBuffer(storage);
+}
+
+ROMBuffer ROMBuffer::read(std::istream& f)
+{
+  std::shared_ptr<Storage> storage(new Storage);
+  std::vector<uint8_t>& buffer = storage->buffer;
+
+  // Size the buffer once if the stream is seekable.
+  std::streampos start = f.tellg();
+  if (start != std::streampos(-1) && f.seekg(0, std::ios::end)) {
+    std::streamoff remaining = f.tellg() - start;
+    f.seekg(start);
+    if (remaining > 0) {
+      buffer.resize(remaining);
+      f.read(reinterpret_cast<char*>(buffer.data()), remaining);
+      buffer.resize(f.gcount());
+    }
+  }
+  f.clear();
+
+  // Pick up anything a non-seekable stream (or a short read) left behind.
+  uint8_t chunk[65536];
+  while (f) {
+    f.read(reinterpret_cast<char*>(chunk), sizeof(chunk));
+    buffer.insert(buffer.end(), chunk, chunk + f.gcount());
+  }
+  buffer.shrink_to_fit();
+  return ROMBuffer(storage);
+}
+
+static const size_t HASH_CHUNK_SIZE = 0x100000;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t finalMix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hashChunk(const uint8_t* data, size_t size, uint64_t seed)
+{
+  static const uint64_t k1 = 0x87C37B91114253D5ULL;
+  static const uint64_t k2 = 0x4CF5AD432745937FULL;
+  uint64_t h = seed ^ (size * k2);
+  for (size_t i = 0; i < size; i += 8) {
+    uint64_t w = 0;
+    size_t n = size - i < 8 ? size - i : 8;
+    for (int j = n - 1; j >= 0; --j) {
+      w = (w << 8) | data[i + j];
+    }
+    w = rotl64(w * k1, 31) * k2;
+    h = rotl64(h ^ w, 27) * 5 + 0x52DCE729;
+  }
+  return finalMix(h);
+}
+
+uint64_t ROMBuffer::contentHash() const
+{
+  if (storage) {
+    std::call_once(storage->hashOnce, [this]{ storage->hash = computeHash(); });
+    return storage->hash;
+  }
+  return computeHash();
+}
+
+uint64_t ROMBuffer::computeHash() const
+{
+  // Chunk boundaries are fixed, so the result doesn't depend on the thread count.
+  size_t numChunks = (len + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+  std::vector<uint64_t> chunks(numChunks);
+  ThreadPool::instance()->parallelFor(numChunks, 1, [this, &chunks](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      size_t start = i * HASH_CHUNK_SIZE;
+      size_t size = len - start < HASH_CHUNK_SIZE ? len - start : HASH_CHUNK_SIZE;
+      chunks[i] = hashChunk(ptr + start, size, i);
+    }
+  });
+  uint64_t h = finalMix(len);
+  for (uint64_t chunk : chunks) {
+    h = finalMix(h ^ chunk) + 0x9E3779B97F4A7C15ULL;
+  }
+  return h;
+}
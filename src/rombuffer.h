@@ -0,0 +1,51 @@
+#ifndef GBAMP2WAV_ROMBUFFER_H
+#define GBAMP2WAV_ROMBUFFER_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <iostream>
+
+// An immutable view of a ROM image. The underlying storage is either a read-only
+// memory mapping of the file or a heap buffer filled from a stream. Copies share
+// the same storage.
+class ROMBuffer {
+public:
+  ROMBuffer();
+
+  // Returns an empty buffer if the file could not be mapped.
+  static ROMBuffer map(const std::string& path);
+  static ROMBuffer read(std::istream& stream);
+
+  inline const uint8_t* data() const { return ptr; }
+  inline size_t size() const { return len; }
+  inline bool empty() const { return !len; }
+  inline const uint8_t* begin() const { return ptr; }
+  inline const uint8_t* end() const { return ptr + len; }
+  inline uint8_t operator[](size_t offset) const { return ptr[offset]; }
+  bool isMapped() const;
+
+  // A fast 64-bit hash of the contents, used to key persistent caches. The
+  // result is remembered by the shared storage.
+  uint64_t contentHash() const;
+
+  template<typename T> inline T parseInt(uint32_t offset) const {
+    T result = 0;
+    for (int i = sizeof(T) - 1; i >= 0; --i) {
+      result = (result << 8) | ptr[offset + i];
+    }
+    return result;
+  }
+
+private:
+  friend class ROMStore;
+  struct Storage;
+  ROMBuffer(std::shared_ptr<const Storage> storage);
+  uint64_t computeHash() const;
+
+  std::shared_ptr<const Storage> storage;
+  const uint8_t* ptr;
+  size_t len;
+};
+
+#endif
@@ -1,8 +1,12 @@
 #include "romfile.h"
 #include "songtable.h"
-#include <algorithm>
+#include "romscanner.h"
+#include "scancache.h"
+#include "gameprofile.h"
+#include "songdata.h"
 #include <fstream>
 #include <sstream>
+#include <unordered_set>
 
 std::string ROMFile::BadAccess::message(uint32_t addr)
 {
@@ -18,20 +22,75 @@ ROMFile::BadAccess::BadAccess(uint32_t addr)
 }
 
 ROMFile::ROMFile(ClefContext* ctx)
-: sampleRate(13379), ctx(ctx)
+: sampleRate(13379), multiboot(false), useScanCache(true), revision(-1), profile(nullptr), ctx(ctx), hash(0), hashValid(false), engineValid(false)
 {
   // initializers only
 }
 
+ROMFile::~ROMFile()
+{
+  // out-of-line so the cache type can stay incomplete in the header
+}
+
 void ROMFile::load(SynthContext* synth, const std::string& path, bool multiboot)
 {
-  std::ifstream f(path);
+  if (path != filename) {
+    ROMBuffer mapped = ROMBuffer::map(path);
+    if (!mapped.empty()) {
+      rom = mapped;
+      filename = path;
+      invalidateCaches();
+    }
+  }
+  if (path == filename) {
+    this->synth = synth;
+    setBaseAddr(multiboot);
+    detectSoundEngine();
+    return;
+  }
+  // Fall back to reading the file if it can't be mapped
+  std::ifstream f(path, std::ios::in | std::ios::binary);
   load(synth, f, path, multiboot);
 }
 
 void ROMFile::load(SynthContext* synth, std::istream& f, const std::string& path, bool multiboot)
 {
   this->synth = synth;
+  setBaseAddr(multiboot);
+  if (path == filename) {
+    detectSoundEngine();
+    return;
+  }
+  rom = ROMBuffer::read(f);
+  filename = path;
+  invalidateCaches();
+  detectSoundEngine();
+}
+
+void ROMFile::load(SynthContext* synth, const ROMBuffer& image, const std::string& path, bool multiboot)
+{
+  this->synth = synth;
+  setBaseAddr(multiboot);
+  if (image.data() != rom.data() || image.size() != rom.size()) {
+    rom = image;
+    invalidateCaches();
+  }
+  filename = path;
+  detectSoundEngine();
+}
+
+void ROMFile::setBaseAddr(bool multiboot)
+{
+  if (multiboot != this->multiboot) {
+    // Scan results depend on the base address
+    {
+      std::lock_guard<std::mutex> guard(cacheLock);
+      cache.reset();
+      engineValid = false;
+    }
+    std::lock_guard<std::mutex> guard(trackLock);
+    tracks.clear();
+  }
   this->multiboot = multiboot;
   if (multiboot) {
     baseAddr = 0x02000000;
@@ -40,15 +99,45 @@ void ROMFile::load(SynthContext* synth, std::istream& f, const std::string& path
     baseAddr = 0x08000000;
     headerSize = 0x200;
   }
-  if (path == filename) {
+}
+
+void ROMFile::detectSoundEngine()
+{
+  if (engineValid) {
     return;
   }
-  uint8_t buffer[1024];
-  while (f) {
-    f.read(reinterpret_cast<char*>(buffer), sizeof(buffer));
-    rom.insert(rom.end(), buffer, buffer + f.gcount());
+  findProfile();
+  engine = SoundEngine::detect(rom, baseAddr);
+  engineValid = true;
+  // Fixed-frequency samples play back at the driver's mixing rate.
+  if (profile && profile->sampleRate) {
+    sampleRate = profile->sampleRate;
+  } else if (engine.sampleRate) {
+    sampleRate = engine.sampleRate;
+  } else {
+    sampleRate = 13379;
   }
-  filename = path;
+}
+
+void ROMFile::findProfile()
+{
+  gameCode.clear();
+  revision = -1;
+  profile = nullptr;
+  if (rom.size() < 0xC0) {
+    return;
+  }
+  for (int i = 0xAC; i < 0xB0; i++) {
+    char ch = rom[i];
+    if (ch < '0' || ch > 'Z' || (ch > '9' && ch < 'A')) {
+      // not a retail header
+      gameCode.clear();
+      return;
+    }
+    gameCode += ch;
+  }
+  revision = rom[0xBC];
+  profile = GameProfiles::instance()->find(gameCode, revision);
 }
 
 uint32_t ROMFile::cleanPointer(uint32_t addr, uint32_t size, bool align) const
@@ -64,141 +153,211 @@ uint32_t ROMFile::cleanDeref(uint32_t addr, uint32_t size, bool alignTarget, boo
 {
   addr = cleanPointer(addr | baseAddr, 4, alignPointer);
   if (addr == BAD_PTR) return BAD_PTR;
-  return cleanPointer(parseInt<uint32_t>(rom, addr), size, alignTarget);
+  return cleanPointer(rom.parseInt<uint32_t>(addr), size, alignTarget);
+}
+
+void ROMFile::invalidateCaches()
+{
+  {
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cache.reset();
+    hashValid = false;
+    engineValid = false;
+  }
+  std::lock_guard<std::mutex> guard(trackLock);
+  tracks.clear();
+}
+
+std::shared_ptr<const DecodedTrack> ROMFile::decodedTrack(uint32_t addr) const
+{
+  std::lock_guard<std::mutex> guard(trackLock);
+  auto iter = tracks.find(addr);
+  if (iter == tracks.end()) {
+    return nullptr;
+  }
+  return iter->second;
+}
+
+std::shared_ptr<const DecodedTrack> ROMFile::storeDecodedTrack(uint32_t addr, std::shared_ptr<const DecodedTrack> track) const
+{
+  std::lock_guard<std::mutex> guard(trackLock);
+  auto result = tracks.emplace(addr, track);
+  return result.first->second;
+}
+
+uint64_t ROMFile::contentHash() const
+{
+  std::lock_guard<std::mutex> guard(cacheLock);
+  if (!hashValid) {
+    hash = rom.contentHash();
+    hashValid = true;
+  }
+  return hash;
+}
+
+ScanCache* ROMFile::scanCache() const
+{
+  if (!useScanCache) {
+    return nullptr;
+  }
+  uint64_t romHash = contentHash();
+  std::lock_guard<std::mutex> guard(cacheLock);
+  if (!cache) {
+    cache.reset(new ScanCache(this, romHash));
+  }
+  return cache->isEnabled() ? cache.get() : nullptr;
 }
 
 SongTable ROMFile::findSongTable(int minSongs, uint32_t offset) const
 {
-  size_t size = rom.size() - 8;
-  SongTable result(this);
-  uint32_t tableStart = 0;
-  std::vector<uint32_t> songs;
-  offset -= 4;
-  int badCount = 0;
-  while ((offset += 4) < size) {
-    uint32_t addr = cleanDeref(offset, 12);
-    if (addr != BAD_PTR && !checkSong(addr, false)) {
-      addr = BAD_PTR;
+  // Known tables are cheap to check, so don't bother caching them.
+  SongTable result;
+  if (findKnownSongTable(minSongs, offset, result)) {
+    return result;
+  }
+  ScanCache* cache = scanCache();
+  std::vector<SongTable> tables;
+  if (cache && cache->lookup(ScanCache::FindSongTable, minSongs, offset, tables) && tables.size() == 1) {
+    return tables[0];
+  }
+  result = ROMScanner(this).findSongTable(minSongs, offset);
+  if (cache) {
+    cache->store(ScanCache::FindSongTable, minSongs, offset, { result });
+  }
+  return result;
+}
+
+bool ROMFile::findKnownSongTable(int minSongs, uint32_t offset, SongTable& table) const
+{
+  // The game profile or the sound driver may say where the table is. Trust
+  // them if there's a table there with enough songs.
+  bool defaultTable = minSongs < 0 && offset <= headerSize;
+  size_t minCount = minSongs < 0 ? 1 : minSongs + 1;
+  if (profile && (defaultTable || offset == profile->songTable)) {
+    table = readSongTable(profile->songTable, profile->numSongs);
+    if (table.songs.size() >= minCount) {
+      return true;
     }
-    if (addr == BAD_PTR) {
-      if (tableStart) {
-        if (songs.size() > result.songs.size()) {
-          result.tableStart = tableStart;
-          result.tableEnd = offset;
-          result.songs = songs;
-          if (minSongs >= 0 && result.songs.size() > minSongs) {
-            return result;
-          }
-        }
-        //songs.clear();
-      }
-      tableStart = 0;
-      continue;
+  }
+  if (engine.songTableAddr && (defaultTable || offset == engine.songTableAddr)) {
+    table = readSongTable(engine.songTableAddr);
+    if (table.songs.size() >= minCount) {
+      return true;
     }
-    if (!tableStart) {
-      tableStart = offset;
+  }
+  return false;
+}
+
+SongTable ROMFile::readSongTable(uint32_t addr, uint32_t maxSongs) const
+{
+  // Same criteria as ROMScanner uses for table entries and songs
+  SongTable table(this);
+  std::unordered_set<uint32_t> seen;
+  uint32_t offset = addr;
+  for (; !maxSongs || offset < addr + maxSongs * 8; offset += 8) {
+    uint32_t word;
+    if (!tryRead(offset, word) || (word & 0xFE000003) != baseAddr) {
+      break;
     }
-    if (std::find(songs.begin(), songs.end(), addr) == songs.end() && checkSong(addr)) {
-      // Song is valid and is not a duplicate
-      songs.push_back(addr);
+    uint32_t song = cleanDeref(offset, 12);
+    if (song == BAD_PTR || !checkSong(song, false)) {
+      break;
+    }
+    if (!seen.count(song) && checkSong(song)) {
+      seen.insert(song);
+      table.songs.push_back(song);
     }
-    offset += 4;
   }
-  if (songs.size() > result.songs.size()) {
-    result.tableStart = tableStart;
-    result.tableEnd = offset;
-    result.songs = songs;
+  if (!table.songs.empty()) {
+    table.tableStart = addr;
+    table.tableEnd = offset;
   }
-  return result;
+  return table;
 }
 
 std::vector<SongTable> ROMFile::findSongTables(uint32_t offset) const
 {
+  ScanCache* cache = scanCache();
   std::vector<SongTable> tables;
-  size_t size = rom.size() - 8;
-  while (offset < size) {
-    SongTable table = findSongTable(0, offset);
-    if (!table.songs.size()) {
-      // Didn't find (another) song table
-      break;
-    }
-    tables.push_back(table);
-    offset = table.tableEnd;
+  if (cache && cache->lookup(ScanCache::FindSongTables, 0, offset, tables)) {
+    return tables;
+  }
+  tables = ROMScanner(this).findSongTables(offset);
+  if (cache) {
+    cache->store(ScanCache::FindSongTables, 0, offset, tables);
   }
   return tables;
 }
 
 SongTable ROMFile::findAllSongs() const
 {
-  SongTable result(this);
-  int size = rom.size() - 12;
-  for (int offset = headerSize; offset < size; offset += 4) {
-    if (checkSong(offset)) {
-      result.songs.push_back(offset);
-      offset += 4;
-    }
+  ScanCache* cache = scanCache();
+  std::vector<SongTable> tables;
+  if (cache && cache->lookup(ScanCache::FindAllSongs, 0, 0, tables) && tables.size() == 1) {
+    return tables[0];
+  }
+  SongTable result = ROMScanner(this).findAllSongs();
+  if (cache) {
+    cache->store(ScanCache::FindAllSongs, 0, 0, { result });
   }
   return result;
 }
 
 bool ROMFile::checkSong(uint32_t addr, bool deep) const
 {
-  try {
-    uint8_t numTracks = rom[addr];
-    if (!numTracks) return !deep;
-    uint32_t end = addr + 8 + numTracks * 4;
-    if (/*(deep && !rom[addr + 1]) || */ end >= rom.size()) {
-      return false;
-    }
-    for (int p = addr + 4; p < end; p += 4) {
-      uint32_t data = cleanDeref(p, 12, false);
-      if (data == BAD_PTR) return false;
-      if (!deep) continue;
-      if (p == addr + 4) {
-        // tone data
-        if (rom[data + 2]) return false;
-        uint8_t inst = rom[data];
-        if (inst > 12 && inst != 16 && inst != 32 && inst != 64 && inst != 128) return false;
-        uint32_t wave = parseInt<uint32_t>(rom, data + 4);
-        if (inst & 0x7) {
-          if (inst & 0x7 == 4) {
-            if (wave > 1) return false;
-          } else if (inst & 0x7 != 3) {
-            if (wave > 3) return false;
-          }
-          if (rom[data + 8] > 7) return false;
-          if (rom[data + 9] > 7) return false;
-          if (rom[data + 10] > 15) return false;
-          if (rom[data + 11] > 7) return false;
+  uint8_t numTracks;
+  if (!tryRead(addr, numTracks)) return false;
+  if (!numTracks) return !deep;
+  uint32_t end = addr + 8 + numTracks * 4;
+  if (/*(deep && !rom[addr + 1]) || */ end >= rom.size()) {
+    return false;
+  }
+  for (int p = addr + 4; p < end; p += 4) {
+    uint32_t data = cleanDeref(p, 12, false);
+    if (data == BAD_PTR) return false;
+    if (!deep) continue;
+    if (p == addr + 4) {
+      // tone data
+      if (rom[data + 2]) return false;
+      uint8_t inst = rom[data];
+      if (inst > 12 && inst != 16 && inst != 32 && inst != 64 && inst != 128) return false;
+      uint32_t wave = rom.parseInt<uint32_t>(data + 4);
+      if (inst & 0x7) {
+        if (inst & 0x7 == 4) {
+          if (wave > 1) return false;
+        } else if (inst & 0x7 != 3) {
+          if (wave > 3) return false;
         }
-        if (inst == 0 || inst == 8 || inst == 3 || inst == 11 || inst == 16 || inst == 32) {
-          wave = cleanPointer(wave, 16);
-          if (wave == BAD_PTR) return false;
-          if (inst & 0x7 == 0) {
-            if (rom[wave] || rom[wave + 1] || rom[wave + 2] || rom[wave + 3] & ~0x40) return false;
-          }
-        } else if (inst == 64 || inst == 128) {
-          if (rom[data + 1] || rom[data + 2] || rom[data + 3]) return false;
-          if (cleanPointer(wave, 16) == BAD_PTR) return false;
-          if (inst == 64) {
-            if (cleanDeref(data + 8, 128) == BAD_PTR) return false;
-          } else {
-            if (parseInt<uint32_t>(rom, data + 8)) return false;
-          }
+        if (rom[data + 8] > 7) return false;
+        if (rom[data + 9] > 7) return false;
+        if (rom[data + 10] > 15) return false;
+        if (rom[data + 11] > 7) return false;
+      }
+      if (inst == 0 || inst == 8 || inst == 3 || inst == 11 || inst == 16 || inst == 32) {
+        wave = cleanPointer(wave, 16);
+        if (wave == BAD_PTR) return false;
+        if (inst & 0x7 == 0) {
+          if (rom[wave] || rom[wave + 1] || rom[wave + 2] || rom[wave + 3] & ~0x40) return false;
+        }
+      } else if (inst == 64 || inst == 128) {
+        if (rom[data + 1] || rom[data + 2] || rom[data + 3]) return false;
+        if (cleanPointer(wave, 16) == BAD_PTR) return false;
+        if (inst == 64) {
+          if (cleanDeref(data + 8, 128) == BAD_PTR) return false;
+        } else {
+          if (rom.parseInt<uint32_t>(data + 8)) return false;
         }
-      } else {
-        // track data
-        uint8_t cmd = rom[data];
-        // track has no events
-        if (deep && cmd == 0xB1) return false;
-        // track starts with running status
-        if (cmd < 0x80) return false;
-        // track starts with unknown command
-        if (cmd == 0xC8 || cmd == 0xC9 || cmd == 0xCA || cmd == 0xCB || cmd == 0xCC) return false;
       }
+    } else {
+      // track data
+      uint8_t cmd = rom[data];
+      // track has no events
+      if (deep && cmd == 0xB1) return false;
+      // track starts with running status
+      if (cmd < 0x80) return false;
+      // track starts with unknown command
+      if (cmd == 0xC8 || cmd == 0xC9 || cmd == 0xCA || cmd == 0xCB || cmd == 0xCC) return false;
     }
-    return true;
-  } catch (...) {
-    return false;
   }
+  return true;
 }
@@ -5,10 +5,18 @@
 #include <vector>
 #include <stdexcept>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "utility.h"
+#include "rombuffer.h"
+#include "soundengine.h"
 class ClefContext;
 class SynthContext;
 class SongTable;
+class ScanCache;
+struct GameProfile;
+struct DecodedTrack;
 
 class ROMFile {
 public:
@@ -26,9 +34,12 @@ public:
   ROMFile(ROMFile&& other) = delete;
   ROMFile& operator=(const ROMFile& other) = delete;
   ROMFile& operator=(ROMFile&& other) = delete;
+  ~ROMFile();
 
   void load(SynthContext* synth, const std::string& path, bool multiboot = false);
   void load(SynthContext* synth, std::istream& stream, const std::string& path, bool multiboot = false);
+  // Uses an image that is already in memory, such as one from ROMStore.
+  void load(SynthContext* synth, const ROMBuffer& image, const std::string& path, bool multiboot = false);
 
   inline ClefContext* context() const { return ctx; }
   inline SynthContext* synthContext() const { return synth; }
@@ -36,38 +47,89 @@ public:
   SongTable findSongTable(int minSongs = -1, uint32_t offset = 0x200) const;
   std::vector<SongTable> findSongTables(uint32_t offset = 0x200) const;
   SongTable findAllSongs() const;
+  // Reads the table at `addr` directly, up to `maxSongs` entries if nonzero.
+  SongTable readSongTable(uint32_t addr, uint32_t maxSongs = 0) const;
   bool checkSong(uint32_t addr, bool deep = true) const;
 
+  // Decoded tracks are shared by every song that uses them. If another thread
+  // stored the same track first, storeDecodedTrack returns that one instead.
+  std::shared_ptr<const DecodedTrack> decodedTrack(uint32_t addr) const;
+  std::shared_ptr<const DecodedTrack> storeDecodedTrack(uint32_t addr, std::shared_ptr<const DecodedTrack> track) const;
+
+  uint64_t contentHash() const;
+  // Returns nullptr if useScanCache is false.
+  ScanCache* scanCache() const;
+
   std::string filename;
-  std::vector<uint8_t> rom;
+  ROMBuffer rom;
+  SoundEngine engine;
   uint32_t sampleRate;
   uint32_t baseAddr;
   uint32_t headerSize;
   bool multiboot;
+  bool useScanCache;
+  // From the cartridge header
+  std::string gameCode;
+  int revision;
+  const GameProfile* profile;
 
   inline uint8_t operator[](uint32_t addr) const { return read<uint8_t>(addr); }
   template<typename T> inline T read(uint32_t addr) const {
-    uint32_t cleaned = cleanPointer(addr | baseAddr, sizeof(T), false);
-    if (cleaned == BAD_PTR) throw BadAccess(addr);
-    return parseInt<T>(rom, cleaned);
+    T value;
+    if (!tryRead(addr, value)) throw BadAccess(addr);
+    return value;
   }
   inline uint32_t readPointer(uint32_t addr, bool align = true) const {
-    uint32_t cleaned = cleanDeref(addr, 4, align, false);
+    uint32_t cleaned = tryReadPointer(addr, align);
     if (cleaned == BAD_PTR) throw BadAccess(addr);
     return cleaned;
   }
   template<typename T> inline T deref(uint32_t addr) const {
+    T value;
+    if (!tryDeref(addr, value)) throw BadAccess(addr);
+    return value;
+  }
+
+  // Non-throwing variants for code that expects to see bad addresses, such as
+  // scanning. These return false or BAD_PTR instead of throwing BadAccess.
+  template<typename T> inline bool tryRead(uint32_t addr, T& value) const {
+    uint32_t cleaned = cleanPointer(addr | baseAddr, sizeof(T), false);
+    if (cleaned == BAD_PTR) return false;
+    value = rom.parseInt<T>(cleaned);
+    return true;
+  }
+  inline uint32_t tryReadPointer(uint32_t addr, bool align = true) const {
+    return cleanDeref(addr, 4, align, false);
+  }
+  template<typename T> inline bool tryDeref(uint32_t addr, T& value) const {
     uint32_t cleaned = cleanDeref(addr, sizeof(T), (sizeof(T) & 3) > 0);
-    if (cleaned == BAD_PTR) throw BadAccess(addr);
-    return parseInt<T>(rom, cleaned);
+    if (cleaned == BAD_PTR) return false;
+    value = rom.parseInt<T>(cleaned);
+    return true;
   }
 
 private:
+  friend class ROMScanner;
+
+  void setBaseAddr(bool multiboot);
+  void detectSoundEngine();
+  void findProfile();
+  bool findKnownSongTable(int minSongs, uint32_t offset, SongTable& table) const;
   uint32_t cleanPointer(uint32_t addr, uint32_t size = 4, bool align = true) const;
   uint32_t cleanDeref(uint32_t addr, uint32_t size = 4, bool align = true, bool alignPointer = true) const;
 
+  void invalidateCaches();
+
   ClefContext* ctx;
   SynthContext* synth;
+
+  mutable std::mutex cacheLock;
+  mutable std::unique_ptr<ScanCache> cache;
+  mutable uint64_t hash;
+  mutable bool hashValid;
+  mutable std::mutex trackLock;
+  mutable std::unordered_map<uint32_t, std::shared_ptr<const DecodedTrack>> tracks;
+  bool engineValid;
 };
 
 #endif
@@ -0,0 +1,282 @@
+#include "romscanner.h"
+#include "romfile.h"
+#include "threadpool.h"
+#include <algorithm>
+#include <unordered_set>
+#include <iostream>
+#include <chrono>
+
+// Number of candidate table entries handed to a worker at a time
+static const size_t ENTRY_GRAIN = 0x400;
+// Number of candidate songs handed to a worker at a time
+static const size_t SONG_GRAIN = 64;
+// Number of 4-byte words handed to a worker at a time when checking every word
+static const size_t WORD_GRAIN = 0x4000;
+// Number of bytes mapped at a time, so that a scan that stops early does
+// not pay for checking the rest of the image
+static const uint32_t WINDOW_SIZE = 0x100000;
+
+ROMScanner::ROMScanner(const ROMFile* rom)
+: rom(rom), mapStart(0), mapEnd(0), mappedEnd(0)
+{
+  pointers.build(rom->rom, rom->baseAddr, rom->headerSize);
+}
+
+SongTable ROMScanner::findSongTable(int minSongs, uint32_t offset)
+{
+  resetMap(offset);
+  return scanTable(minSongs, offset);
+}
+
+std::vector<SongTable> ROMScanner::findSongTables(uint32_t offset)
+{
+  // Every run of table entries that refers to at least one valid song is a
+  // table. This is what calling findSongTable(0, offset) from the end of each
+  // previous table would report, but in one pass.
+  std::vector<SongTable> tables;
+  SongTable table(rom);
+  std::unordered_set<uint32_t> seen;
+  resetMap(offset);
+  for (; offset < mapEnd; offset += 4) {
+    if (!isTableEntry(offset)) {
+      if (table.tableStart && table.songs.size()) {
+        table.tableEnd = offset;
+        tables.push_back(table);
+      }
+      table.tableStart = 0;
+      table.songs.clear();
+      seen.clear();
+      continue;
+    }
+    if (!table.tableStart) {
+      table.tableStart = offset;
+    }
+    uint32_t addr = rom->cleanDeref(offset, 12);
+    if (!seen.count(addr) && isValidSong(addr)) {
+      // Song is valid and is not a duplicate
+      seen.insert(addr);
+      table.songs.push_back(addr);
+    }
+    offset += 4;
+  }
+  if (table.tableStart && table.songs.size()) {
+    table.tableEnd = offset;
+    tables.push_back(table);
+  }
+  return tables;
+}
+
+SongTable ROMScanner::findAllSongs()
+{
+  SongTable result(rom);
+  uint32_t start = rom->headerSize;
+  uint32_t size = rom->rom.size() < 12 ? 0 : rom->rom.size() - 12;
+  if (size <= start) {
+    return result;
+  }
+  // A song header has a non-zero track count followed by a pointer
+  std::vector<uint32_t> candidates;
+  for (uint32_t offset = pointers.nextPointer(start + 4, size + 4); offset < size + 4; offset = pointers.nextPointer(offset + 4, size + 4)) {
+    if (rom->rom[offset - 4]) {
+      candidates.push_back(offset - 4);
+    }
+  }
+  std::vector<uint8_t> valid(candidates.size());
+  ThreadPool::instance()->parallelFor(candidates.size(), SONG_GRAIN, [this, &candidates, &valid](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      valid[i] = rom->checkSong(candidates[i]);
+    }
+  });
+  uint32_t nextOffset = start;
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (valid[i] && candidates[i] >= nextOffset) {
+      result.songs.push_back(candidates[i]);
+      // A song header is at least 8 bytes, so skip the next word
+      nextOffset = candidates[i] + 8;
+    }
+  }
+  return result;
+}
+
+void ROMScanner::resetMap(uint32_t offset)
+{
+  uint32_t size = rom->rom.size() < 8 ? 0 : rom->rom.size() - 8;
+  mapStart = offset;
+  mapEnd = offset < size ? size : offset;
+  mappedEnd = offset;
+  tableEntries.clear();
+  songValid.clear();
+}
+
+void ROMScanner::mapWindow()
+{
+  uint32_t windowStart = mappedEnd;
+  uint32_t windowEnd = mapEnd - windowStart > WINDOW_SIZE ? windowStart + WINDOW_SIZE : mapEnd;
+  size_t first = tableEntries.size();
+  size_t count = (windowEnd - windowStart + 3) / 4;
+  tableEntries.resize(first + count);
+  mappedEnd = windowStart + count * 4;
+
+  // Only words that look like aligned pointers can be table entries
+  std::vector<uint32_t> candidates;
+  if (!(windowStart & 3)) {
+    for (uint32_t offset = pointers.nextAlignedPointer(windowStart, mappedEnd); offset < mappedEnd; offset = pointers.nextAlignedPointer(offset + 4, mappedEnd)) {
+      candidates.push_back(offset);
+    }
+  }
+  uint8_t* flags = tableEntries.data() + first;
+  ThreadPool::instance()->parallelFor(candidates.size(), ENTRY_GRAIN, [this, windowStart, flags, &candidates](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      uint32_t addr = rom->cleanDeref(candidates[i], 12);
+      flags[(candidates[i] - windowStart) / 4] = addr != ROMFile::BAD_PTR && rom->checkSong(addr, false);
+    }
+  });
+
+  // Run the deep check up front on every new song the window refers to. The
+  // serial walk skips duplicates, but the check has no side effects, so this
+  // can't change the outcome.
+  std::vector<uint32_t> songs;
+  for (uint32_t offset : candidates) {
+    if (flags[(offset - windowStart) / 4]) {
+      uint32_t addr = rom->cleanDeref(offset, 12);
+      if (!songValid.count(addr)) {
+        songs.push_back(addr);
+      }
+    }
+  }
+  std::sort(songs.begin(), songs.end());
+  songs.erase(std::unique(songs.begin(), songs.end()), songs.end());
+  std::vector<uint8_t> valid(songs.size());
+  ThreadPool::instance()->parallelFor(songs.size(), SONG_GRAIN, [this, &songs, &valid](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      valid[i] = rom->checkSong(songs[i]);
+    }
+  });
+  for (size_t i = 0; i < songs.size(); i++) {
+    songValid[songs[i]] = valid[i];
+  }
+}
+
+bool ROMScanner::isTableEntry(uint32_t offset)
+{
+  if (offset < mapStart || offset >= mapEnd) {
+    return false;
+  }
+  while (offset >= mappedEnd) {
+    mapWindow();
+  }
+  return tableEntries[(offset - mapStart) / 4];
+}
+
+bool ROMScanner::isValidSong(uint32_t addr) const
+{
+  auto iter = songValid.find(addr);
+  if (iter == songValid.end()) {
+    return rom->checkSong(addr);
+  }
+  return iter->second;
+}
+
+SongTable ROMScanner::scanTable(int minSongs, uint32_t offset)
+{
+  SongTable result(rom);
+  uint32_t tableStart = 0;
+  std::vector<uint32_t> songs;
+  std::unordered_set<uint32_t> seen;
+  for (; offset < mapEnd; offset += 4) {
+    if (!isTableEntry(offset)) {
+      if (tableStart) {
+        if (songs.size() > result.songs.size()) {
+          result.tableStart = tableStart;
+          result.tableEnd = offset;
+          result.songs = songs;
+          if (minSongs >= 0 && result.songs.size() > minSongs) {
+            return result;
+          }
+        }
+      }
+      tableStart = 0;
+      continue;
+    }
+    if (!tableStart) {
+      tableStart = offset;
+    }
+    uint32_t addr = rom->cleanDeref(offset, 12);
+    if (!seen.count(addr) && isValidSong(addr)) {
+      // Song is valid and is not a duplicate
+      seen.insert(addr);
+      songs.push_back(addr);
+    }
+    offset += 4;
+  }
+  if (songs.size() > result.songs.size()) {
+    result.tableStart = tableStart;
+    result.tableEnd = offset;
+    result.songs = songs;
+  }
+  return result;
+}
+
+bool ROMScanner::benchmark(const ROMFile* rom, std::ostream& out)
+{
+  typedef std::chrono::steady_clock Clock;
+  auto elapsed = [](Clock::time_point since) {
+    return std::chrono::duration<double>(Clock::now() - since).count();
+  };
+  uint32_t start = rom->headerSize;
+  uint32_t size = rom->rom.size() < 12 ? 0 : rom->rom.size() - 12;
+  size_t count = size > start ? (size - start + 3) / 4 : 0;
+  uint32_t end = start + count * 4;
+
+  // Without the pointer map, every word is checked both as a table entry and
+  // as the start of a song.
+  Clock::time_point timer = Clock::now();
+  std::vector<uint8_t> allEntries(count), allSongs(count);
+  ThreadPool::instance()->parallelFor(count, WORD_GRAIN, [rom, start, &allEntries, &allSongs](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      uint32_t addr = rom->cleanDeref(start + i * 4, 12);
+      allEntries[i] = addr != ROMFile::BAD_PTR && rom->checkSong(addr, false);
+      allSongs[i] = rom->checkSong(start + i * 4);
+    }
+  });
+  double allTime = elapsed(timer);
+
+  timer = Clock::now();
+  PointerMap pointers;
+  pointers.build(rom->rom, rom->baseAddr, rom->headerSize);
+  double buildTime = elapsed(timer);
+  std::vector<uint32_t> entries, songs;
+  if (!(start & 3)) {
+    for (uint32_t offset = pointers.nextAlignedPointer(start, end); offset < end; offset = pointers.nextAlignedPointer(offset + 4, end)) {
+      entries.push_back(offset);
+    }
+  }
+  for (uint32_t offset = pointers.nextPointer(start + 4, end + 4); offset < end + 4; offset = pointers.nextPointer(offset + 4, end + 4)) {
+    if (rom->rom[offset - 4]) {
+      songs.push_back(offset - 4);
+    }
+  }
+  std::vector<uint8_t> mapEntries(count), mapSongs(count);
+  ThreadPool::instance()->parallelFor(entries.size(), ENTRY_GRAIN, [rom, start, &entries, &mapEntries](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      uint32_t addr = rom->cleanDeref(entries[i], 12);
+      mapEntries[(entries[i] - start) / 4] = addr != ROMFile::BAD_PTR && rom->checkSong(addr, false);
+    }
+  });
+  ThreadPool::instance()->parallelFor(songs.size(), SONG_GRAIN, [rom, start, &songs, &mapSongs](size_t first, size_t last) {
+    for (size_t i = first; i < last; i++) {
+      mapSongs[(songs[i] - start) / 4] = rom->checkSong(songs[i]);
+    }
+  });
+  double mapTime = elapsed(timer);
+
+  bool match = allEntries == mapEntries && allSongs == mapSongs;
+  out << "Checked " << count << " words using " << ThreadPool::instance()->size() << " threads" << std::endl;
+  out << "Every word:   " << allTime << " s" << std::endl;
+  out << "Pointer map:  " << mapTime << " s (" << buildTime << " s to build with " << PointerMap::implementation() << ", "
+      << entries.size() << " entry and " << songs.size() << " song candidates)" << std::endl;
+  out << "Table entries found: " << std::count(allEntries.begin(), allEntries.end(), 1)
+      << ", songs found: " << std::count(allSongs.begin(), allSongs.end(), 1) << std::endl;
+  out << (match ? "Results match" : "Results differ") << std::endl;
+  return match;
+}
@@ -0,0 +1,45 @@
+#ifndef GBAMP2WAV_ROMSCANNER_H
+#define GBAMP2WAV_ROMSCANNER_H
+
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <iosfwd>
+#include "songtable.h"
+#include "pointermap.h"
+class ROMFile;
+
+// Searches a ROM image for song tables and songs. Only offsets that hold
+// something resembling a pointer are checked, and those checks are spread
+// across the shared thread pool; the results are then walked in order so that
+// the output is identical to a serial scan.
+class ROMScanner {
+public:
+  ROMScanner(const ROMFile* rom);
+
+  SongTable findSongTable(int minSongs, uint32_t offset);
+  std::vector<SongTable> findSongTables(uint32_t offset);
+  SongTable findAllSongs();
+
+  // Times the checks the scans make on every word of the image against the
+  // same checks limited to the pointer map's candidates, and makes sure they
+  // agree. Returns false if they don't.
+  static bool benchmark(const ROMFile* rom, std::ostream& out);
+
+private:
+  void resetMap(uint32_t offset);
+  void mapWindow();
+  bool isTableEntry(uint32_t offset);
+  bool isValidSong(uint32_t addr) const;
+  SongTable scanTable(int minSongs, uint32_t offset);
+
+  const ROMFile* rom;
+  PointerMap pointers;
+  uint32_t mapStart, mapEnd, mappedEnd;
+  // One flag per 4-byte word in [mapStart, mappedEnd)
+  std::vector<uint8_t> tableEntries;
+  // Deep check results for songs referenced by mapped table entries
+  std::unordered_map<uint32_t, bool> songValid;
+};
+
+#endif
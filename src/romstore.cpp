@@ -0,0 +1,91 @@
+#include "romstore.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+ROMStore* ROMStore::instance()
+{
+  // Leaked so that it outlives any plugin instance torn down at exit.
+  static ROMStore* store = new ROMStore;
+  return store;
+}
+
+static bool statFile(const std::string& path, uint64_t& size, int64_t& mtime)
+{
+#ifdef _WIN32
+  struct _stat64 st;
+  if (_stat64(path.c_str(), &st) != 0 || !(st.st_mode & _S_IFREG)) {
+    return false;
+  }
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+#endif
+  size = st.st_size;
+  mtime = st.st_mtime;
+  return true;
+}
+
+static bool streamSize(std::istream& stream, uint64_t& size)
+{
+  std::streampos start = stream.tellg();
+  if (start == std::streampos(-1) || !stream.seekg(0, std::ios::end)) {
+    stream.clear();
+    return false;
+  }
+  std::streamoff remaining = stream.tellg() - start;
+  stream.seekg(start);
+  size = remaining;
+  return remaining > 0;
+}
+
+ROMBuffer ROMStore::open(const std::string& path, std::istream& stream)
+{
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  bool isFile = statFile(path, size, mtime);
+  if (!isFile && !streamSize(stream, size)) {
+    // Nothing to recognize it by next time
+    return ROMBuffer::read(stream);
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = entries.find(path);
+    if (iter != entries.end() && iter->second.size == size && iter->second.mtime == mtime) {
+      std::shared_ptr<const ROMBuffer::Storage> storage = iter->second.storage.lock();
+      if (storage) {
+        return ROMBuffer(storage);
+      }
+    }
+  }
+
+  // Load without holding the lock so other files aren't held up.
+  ROMBuffer image;
+  if (isFile) {
+    image = ROMBuffer::map(path);
+  }
+  if (image.empty()) {
+    image = ROMBuffer::read(stream);
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto iter = entries.begin(); iter != entries.end(); ) {
+    if (iter->second.storage.expired()) {
+      iter = entries.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  Entry& entry = entries[path];
+  std::shared_ptr<const ROMBuffer::Storage> existing = entry.storage.lock();
+  if (existing && entry.size == size && entry.mtime == mtime) {
+    // Another thread loaded the same file first
+    return ROMBuffer(existing);
+  }
+  entry.size = size;
+  entry.mtime = mtime;
+  entry.storage = image.storage;
+  return image;
+}
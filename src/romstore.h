@@ -0,0 +1,37 @@
+#ifndef GBAMP2WAV_ROMSTORE_H
+#define GBAMP2WAV_ROMSTORE_H
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <iostream>
+#include "rombuffer.h"
+
+// Process-wide registry of loaded ROM images. Everything that opens the same
+// unchanged file gets the same immutable buffer; an image is freed when the
+// last ROMBuffer referring to it goes away.
+class ROMStore {
+public:
+  static ROMStore* instance();
+
+  // Returns the shared image for `path`, loading it if necessary. A file is
+  // considered unchanged if its size and modification time match. If the path
+  // can't be examined directly (for instance, when it's only meaningful to a
+  // host's virtual filesystem) only the size of `stream` is compared. The image
+  // is read from `stream` unless the file can be memory-mapped.
+  ROMBuffer open(const std::string& path, std::istream& stream);
+
+private:
+  struct Entry {
+    uint64_t size;
+    int64_t mtime;
+    std::weak_ptr<const ROMBuffer::Storage> storage;
+  };
+
+  std::mutex lock;
+  std::map<std::string, Entry> entries;
+};
+
+#endif
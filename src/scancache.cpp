@@ -0,0 +1,271 @@
+#include "scancache.h"
+#include "romfile.h"
+#include "binaryio.h"
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+
+static const char SCAN_CACHE_MAGIC[8] = { 'M', 'P', '2', 'K', 'S', 'C', 'A', 'N' };
+// Increment whenever the file layout or the meaning of a cached result changes.
+static const uint32_t SCAN_CACHE_VERSION = 3;
+
+ScanCache::ScanCache(const ROMFile* rom, uint64_t hash)
+: rom(rom), hash(hash), dirty(false)
+{
+  std::string dir = cacheDirectory();
+  if (dir.empty()) {
+    return;
+  }
+  std::ostringstream ss;
+  ss << dir << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << (rom->multiboot ? ".mb" : "") << ".scan";
+  path = ss.str();
+
+  std::string data;
+  if (readWholeFile(path, data)) {
+    BinaryReader reader(data);
+    if (!read(reader)) {
+      // Stale or corrupt: start over
+      queries.clear();
+      songs.clear();
+      analyses.clear();
+    }
+  }
+}
+
+ScanCache::~ScanCache()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  if (dirty) {
+    saveLocked();
+  }
+}
+
+bool ScanCache::lookup(Query query, int minSongs, uint32_t offset, std::vector<SongTable>& tables)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto iter = queries.find(QueryKey(query, minSongs, offset));
+  if (iter == queries.end()) {
+    return false;
+  }
+  tables.clear();
+  for (const TableRecord& record : iter->second) {
+    SongTable table(rom);
+    table.tableStart = record.tableStart;
+    table.tableEnd = record.tableEnd;
+    table.songs = record.songs;
+    tables.push_back(table);
+  }
+  return true;
+}
+
+void ScanCache::store(Query query, int minSongs, uint32_t offset, const std::vector<SongTable>& tables)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<TableRecord>& records = queries[QueryKey(query, minSongs, offset)];
+  records.clear();
+  for (const SongTable& table : tables) {
+    records.push_back(TableRecord{ table.tableStart, table.tableEnd, table.songs });
+  }
+  // Scans are the expensive part, so write them out right away.
+  saveLocked();
+}
+
+bool ScanCache::songStatus(uint32_t addr, SongStatus& status)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto iter = songs.find(addr);
+  if (iter == songs.end()) {
+    return false;
+  }
+  status = iter->second;
+  return true;
+}
+
+void ScanCache::setSongStatus(uint32_t addr, const SongStatus& status)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  songs[addr] = status;
+  dirty = true;
+}
+
+bool ScanCache::songAnalysis(uint32_t addr, SongAnalysis& analysis)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  auto iter = analyses.find(addr);
+  if (iter == analyses.end()) {
+    return false;
+  }
+  analysis = iter->second;
+  return true;
+}
+
+void ScanCache::setSongAnalysis(uint32_t addr, const SongAnalysis& analysis)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  analyses[addr] = analysis;
+  dirty = true;
+}
+
+void ScanCache::save()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  saveLocked();
+}
+
+void ScanCache::saveLocked()
+{
+  dirty = false;
+  if (path.empty()) {
+    return;
+  }
+
+  // Another process may have written results since this file was loaded.
+  // Merge them in, with this instance's results taking precedence.
+  std::map<QueryKey, std::vector<TableRecord>> newQueries;
+  std::map<uint32_t, SongStatus> newSongs;
+  std::map<uint32_t, SongAnalysis> newAnalyses;
+  newQueries.swap(queries);
+  newSongs.swap(songs);
+  newAnalyses.swap(analyses);
+  std::string data;
+  if (readWholeFile(path, data)) {
+    BinaryReader reader(data);
+    if (!read(reader)) {
+      queries.clear();
+      songs.clear();
+      analyses.clear();
+    }
+  }
+  for (auto& iter : newQueries) {
+    queries[iter.first] = std::move(iter.second);
+  }
+  for (auto& iter : newSongs) {
+    songs[iter.first] = std::move(iter.second);
+  }
+  for (auto& iter : newAnalyses) {
+    analyses[iter.first] = iter.second;
+  }
+
+  BinaryWriter writer;
+  write(writer);
+  makePath(path.substr(0, path.find_last_of("/\\")));
+  writer.saveAtomic(path);
+}
+
+bool ScanCache::read(BinaryReader& reader)
+{
+  char magic[sizeof(SCAN_CACHE_MAGIC)];
+  for (char& ch : magic) {
+    reader.read(ch);
+  }
+  uint32_t version = 0, romSize = 0;
+  uint64_t fileHash = 0;
+  uint8_t multiboot = 0;
+  reader.read(version);
+  reader.read(fileHash);
+  reader.read(romSize);
+  reader.read(multiboot);
+  if (!reader.ok() || std::memcmp(magic, SCAN_CACHE_MAGIC, sizeof(magic)) || version != SCAN_CACHE_VERSION) {
+    return false;
+  }
+  if (fileHash != hash || romSize != rom->rom.size() || bool(multiboot) != rom->multiboot) {
+    return false;
+  }
+
+  uint32_t numQueries = 0;
+  reader.read(numQueries);
+  for (uint32_t i = 0; i < numQueries && reader.ok(); i++) {
+    uint8_t query = 0;
+    int32_t minSongs = 0;
+    uint32_t offset = 0, numTables = 0;
+    reader.read(query);
+    reader.read(minSongs);
+    reader.read(offset);
+    reader.read(numTables);
+    std::vector<TableRecord>& records = queries[QueryKey(query, minSongs, offset)];
+    records.clear();
+    for (uint32_t j = 0; j < numTables && reader.ok(); j++) {
+      TableRecord record;
+      uint32_t numSongs = 0;
+      reader.read(record.tableStart);
+      reader.read(record.tableEnd);
+      reader.read(numSongs);
+      for (uint32_t k = 0; k < numSongs && reader.ok(); k++) {
+        uint32_t song = 0;
+        reader.read(song);
+        record.songs.push_back(song);
+      }
+      records.push_back(record);
+    }
+  }
+
+  uint32_t numSongs = 0;
+  reader.read(numSongs);
+  for (uint32_t i = 0; i < numSongs && reader.ok(); i++) {
+    uint32_t addr = 0;
+    int32_t numTracks = 0;
+    SongStatus status;
+    reader.read(addr);
+    reader.read(numTracks);
+    reader.readString(status.error);
+    status.numTracks = numTracks;
+    songs[addr] = status;
+  }
+
+  uint32_t numAnalyses = 0;
+  reader.read(numAnalyses);
+  for (uint32_t i = 0; i < numAnalyses && reader.ok(); i++) {
+    uint32_t addr = 0;
+    int32_t numTracks = 0;
+    SongAnalysis analysis;
+    reader.read(addr);
+    reader.read(numTracks);
+    reader.read(analysis.duration);
+    reader.read(analysis.loopStart);
+    reader.read(analysis.loopEnd);
+    analysis.numTracks = numTracks;
+    analyses[addr] = analysis;
+  }
+  return reader.ok();
+}
+
+void ScanCache::write(BinaryWriter& writer) const
+{
+  writer.writeBytes(SCAN_CACHE_MAGIC, sizeof(SCAN_CACHE_MAGIC));
+  writer.write<uint32_t>(SCAN_CACHE_VERSION);
+  writer.write<uint64_t>(hash);
+  writer.write<uint32_t>(rom->rom.size());
+  writer.write<uint8_t>(rom->multiboot);
+
+  writer.write<uint32_t>(queries.size());
+  for (const auto& iter : queries) {
+    writer.write<uint8_t>(std::get<0>(iter.first));
+    writer.write<int32_t>(std::get<1>(iter.first));
+    writer.write<uint32_t>(std::get<2>(iter.first));
+    writer.write<uint32_t>(iter.second.size());
+    for (const TableRecord& record : iter.second) {
+      writer.write<uint32_t>(record.tableStart);
+      writer.write<uint32_t>(record.tableEnd);
+      writer.write<uint32_t>(record.songs.size());
+      for (uint32_t song : record.songs) {
+        writer.write<uint32_t>(song);
+      }
+    }
+  }
+
+  writer.write<uint32_t>(songs.size());
+  for (const auto& iter : songs) {
+    writer.write<uint32_t>(iter.first);
+    writer.write<int32_t>(iter.second.numTracks);
+    writer.writeString(iter.second.error);
+  }
+
+  writer.write<uint32_t>(analyses.size());
+  for (const auto& iter : analyses) {
+    writer.write<uint32_t>(iter.first);
+    writer.write<int32_t>(iter.second.numTracks);
+    writer.write(iter.second.duration);
+    writer.write(iter.second.loopStart);
+    writer.write(iter.second.loopEnd);
+  }
+}
@@ -0,0 +1,73 @@
+#ifndef GBAMP2WAV_SCANCACHE_H
+#define GBAMP2WAV_SCANCACHE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "songtable.h"
+#include "songanalysis.h"
+class ROMFile;
+class BinaryReader;
+class BinaryWriter;
+
+// Persistent record of scan results for a ROM image, kept in the user's cache
+// directory and keyed by a hash of the image contents and the multiboot flag.
+// Files with a different format version or key are ignored.
+class ScanCache {
+public:
+  enum Query {
+    FindSongTable = 1,
+    FindSongTables = 2,
+    FindAllSongs = 3,
+  };
+
+  struct SongStatus {
+    // -1 if the song failed to load
+    int numTracks;
+    std::string error;
+  };
+
+  ScanCache(const ROMFile* rom, uint64_t hash);
+  ScanCache(const ScanCache& other) = delete;
+  ScanCache& operator=(const ScanCache& other) = delete;
+  ~ScanCache();
+
+  inline bool isEnabled() const { return !path.empty(); }
+
+  bool lookup(Query query, int minSongs, uint32_t offset, std::vector<SongTable>& tables);
+  void store(Query query, int minSongs, uint32_t offset, const std::vector<SongTable>& tables);
+
+  bool songStatus(uint32_t addr, SongStatus& status);
+  void setSongStatus(uint32_t addr, const SongStatus& status);
+
+  // A song that couldn't be analyzed is recorded with numTracks set to -1.
+  bool songAnalysis(uint32_t addr, SongAnalysis& analysis);
+  void setSongAnalysis(uint32_t addr, const SongAnalysis& analysis);
+
+  void save();
+
+private:
+  typedef std::tuple<int, int, uint32_t> QueryKey;
+  struct TableRecord {
+    uint32_t tableStart, tableEnd;
+    std::vector<uint32_t> songs;
+  };
+
+  bool read(BinaryReader& reader);
+  void write(BinaryWriter& writer) const;
+  void saveLocked();
+
+  const ROMFile* rom;
+  std::string path;
+  uint64_t hash;
+  std::mutex lock;
+  bool dirty;
+  std::map<QueryKey, std::vector<TableRecord>> queries;
+  std::map<uint32_t, SongStatus> songs;
+  std::map<uint32_t, SongAnalysis> analyses;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "songanalysis.h"
+#include "romfile.h"
+#include "songdata.h"
+#include "instrumentdata.h"
+#include "threadpool.h"
+#include "scancache.h"
+
+SongAnalysis analyzeSong(const ROMFile* rom, uint32_t addr)
+{
+  int numTracks = rom->read<uint8_t>(addr);
+  std::vector<uint32_t> trackAddrs;
+  for (int i = 0; i < numTracks; i++) {
+    trackAddrs.push_back(rom->readPointer(addr + 8 + i * 4, false));
+  }
+  // An empty instrument table keeps the instruments from being loaded.
+  uint32_t table[128] = { 0 };
+  std::unique_ptr<SongData> song(new SongData(rom, addr, InstrumentData(table), trackAddrs));
+  song->decodeAll();
+
+  SongAnalysis result;
+  result.numTracks = song->numTracks();
+  result.duration = 0;
+  for (int i = 0; i < result.numTracks; i++) {
+    double length = song->getTrack(i)->length();
+    if (length > result.duration) {
+      result.duration = length;
+    }
+  }
+  uint64_t loopStart, loopEnd;
+  if (song->findLoop(loopStart, loopEnd)) {
+    result.loopStart = song->tempoMap().tickToTime(loopStart);
+    result.loopEnd = song->tempoMap().tickToTime(loopEnd);
+  } else {
+    result.loopStart = result.loopEnd = -1;
+  }
+  return result;
+}
+
+SongEnumerator::Work::Work(ROMFile* rom, const std::vector<uint32_t>& songs)
+: songs(songs), rom(rom), states(songs.size(), Pending), results(songs.size()), remaining(songs.size()), cancelled(false),
+  done(false)
+{
+  // initializers only
+}
+
+SongEnumerator::Workers& SongEnumerator::workers()
+{
+  // Leaked, so that a worker still running at exit isn't destroyed under it
+  static Workers* workers = new Workers;
+  return *workers;
+}
+
+SongEnumerator::SongEnumerator(ROMFile* rom, const std::vector<uint32_t>& songs)
+: songs(songs), work(new Work(rom, songs))
+{
+  Workers& registry = workers();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  for (auto iter = registry.running.begin(); iter != registry.running.end(); ) {
+    if ((*iter)->done) {
+      (*iter)->worker.join();
+      iter = registry.running.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+  work->worker = std::thread(&Work::run, work.get());
+  registry.running.push_back(work);
+}
+
+SongEnumerator::~SongEnumerator()
+{
+  cancel();
+}
+
+void SongEnumerator::shutdown()
+{
+  std::vector<std::shared_ptr<Work>> running;
+  {
+    Workers& registry = workers();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    running.swap(registry.running);
+  }
+  for (const auto& work : running) {
+    work->cancel();
+  }
+  for (const auto& work : running) {
+    work->worker.join();
+  }
+}
+
+void SongEnumerator::Work::run()
+{
+  ScanCache* cache = rom->scanCache();
+  std::atomic<bool> updated(false);
+  ThreadPool::instance()->parallelFor(songs.size(), 1, [this, cache, &updated](size_t start, size_t end) {
+    for (size_t i = start; i < end && !cancelled; i++) {
+      SongAnalysis analysis = SongAnalysis();
+      SongState state = Analyzed;
+      if (cache && cache->songAnalysis(songs[i], analysis)) {
+        state = analysis.numTracks < 0 ? Failed : Analyzed;
+      } else {
+        try {
+          analysis = analyzeSong(rom.get(), songs[i]);
+        } catch (...) {
+          state = Failed;
+          analysis.numTracks = -1;
+        }
+        if (cache) {
+          cache->setSongAnalysis(songs[i], analysis);
+          updated = true;
+        }
+      }
+      std::lock_guard<std::mutex> guard(lock);
+      results[i] = analysis;
+      states[i] = state;
+      --remaining;
+      changed.notify_all();
+    }
+  });
+  if (updated) {
+    cache->save();
+  }
+  done = true;
+}
+
+void SongEnumerator::Work::cancel()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  cancelled = true;
+  changed.notify_all();
+}
+
+void SongEnumerator::cancel()
+{
+  work->cancel();
+}
+
+bool SongEnumerator::isCancelled() const
+{
+  return work->cancelled;
+}
+
+bool SongEnumerator::waitForSong(size_t index, SongAnalysis& analysis)
+{
+  if (index >= songs.size()) {
+    return false;
+  }
+  Work* work = this->work.get();
+  std::unique_lock<std::mutex> guard(work->lock);
+  work->changed.wait(guard, [work, index]{ return work->cancelled || work->states[index] != Pending; });
+  if (work->states[index] != Analyzed) {
+    return false;
+  }
+  analysis = work->results[index];
+  return true;
+}
+
+bool SongEnumerator::waitForAll()
+{
+  Work* work = this->work.get();
+  std::unique_lock<std::mutex> guard(work->lock);
+  work->changed.wait(guard, [work]{ return work->cancelled || !work->remaining; });
+  return !work->remaining;
+}
@@ -0,0 +1,92 @@
+#ifndef GBAMP2WAV_SONGANALYSIS_H
+#define GBAMP2WAV_SONGANALYSIS_H
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+class ROMFile;
+
+// Timing information about a song, taken from its decoded sequence data and
+// tempo map. Analyzing a song doesn't load its instruments or samples, and the
+// ROM doesn't need a synth context.
+struct SongAnalysis {
+  int numTracks;
+  // The same as the length of the song's longest track.
+  double duration;
+  // In seconds. Both are -1 if the song doesn't loop.
+  double loopStart, loopEnd;
+};
+
+// Throws if the song can't be decoded.
+SongAnalysis analyzeSong(const ROMFile* rom, uint32_t addr);
+
+// Analyzes a list of songs in the background using the shared thread pool.
+// Each result is available as soon as that song is done, so a caller can wait
+// for the song it needs while the rest are still being analyzed. Results are
+// kept in the ROM's scan cache, if it has one.
+class SongEnumerator {
+public:
+  // Takes ownership of the ROM. Analysis uses neither a synth nor a ClefContext,
+  // so the ROM should be loaded without them; it may outlive whoever made it.
+  SongEnumerator(ROMFile* rom, const std::vector<uint32_t>& songs);
+  SongEnumerator(const SongEnumerator& other) = delete;
+  SongEnumerator& operator=(const SongEnumerator& other) = delete;
+  // Cancels any remaining work. Songs already being analyzed finish in the
+  // background, so this doesn't wait for them.
+  ~SongEnumerator();
+
+  // Cancels every enumeration and waits for their workers to stop. Call this
+  // before the code they run goes away, such as when a plugin is unloaded.
+  static void shutdown();
+
+  const std::vector<uint32_t> songs;
+  inline const ROMFile* romFile() const { return work->rom.get(); }
+
+  // Songs that haven't started yet are skipped. Songs being analyzed finish
+  // first, but waitForSong() and waitForAll() return immediately.
+  void cancel();
+  bool isCancelled() const;
+
+  // Blocks until songs[index] has been analyzed. Returns false if it couldn't
+  // be decoded or the enumeration was cancelled first.
+  bool waitForSong(size_t index, SongAnalysis& analysis);
+  // Blocks until every song has been analyzed. Returns false if cancelled.
+  bool waitForAll();
+
+private:
+  enum SongState { Pending, Analyzed, Failed };
+
+  // Outlives the enumerator until the worker thread has been joined.
+  struct Work {
+    Work(ROMFile* rom, const std::vector<uint32_t>& songs);
+    void run();
+    void cancel();
+
+    const std::vector<uint32_t> songs;
+    std::unique_ptr<ROMFile> rom;
+    std::vector<SongState> states;
+    std::vector<SongAnalysis> results;
+    size_t remaining;
+    std::atomic<bool> cancelled;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread worker;
+    std::atomic<bool> done;
+  };
+  std::shared_ptr<Work> work;
+
+  // Workers that haven't been joined yet. Dropping an enumerator doesn't join
+  // its worker, so that it never blocks; finished workers are joined when the
+  // next enumeration starts, and the rest by shutdown().
+  struct Workers {
+    std::mutex lock;
+    std::vector<std::shared_ptr<Work>> running;
+  };
+  static Workers& workers();
+};
+
+#endif
@@ -1,8 +1,13 @@
 #include "songdata.h"
 #include "romfile.h"
+#include "threadpool.h"
+#include "eventpool.h"
+#include "trace.h"
 #include "synth/audionode.h"
 #include "synth/synthcontext.h"
 #include <unordered_map>
+#include <algorithm>
+#include <cmath>
 #include <sstream>
 #include <iomanip>
 
@@ -98,7 +103,8 @@ std::string RawEvent::render() const {
     ss << " " << (opcode - 0xCF);
     first = false;
   }
-  for (uint32_t arg : args) {
+  for (int i = 0; i < numArgs; i++) {
+    uint32_t arg = args[i];
     if (first) {
       first = false;
       ss << " ";
@@ -115,27 +121,59 @@ std::string RawEvent::render() const {
 }
 
 TrackData::TrackData(SongData* song, int index, uint32_t addr, MpInstrument* defaultInst)
-: trackIndex(index), song(song), addr(addr), hasLoop(true), preamp(1.0), playIndex(0), playTime(0), secPerTick(1.0 / 75.0),
-  lengthCache(-1), currentInstrument(defaultInst), bendRange(2), transpose(0), tuning(0), stopped(false)
+: trackIndex(index), song(song), addr(addr), hasLoop(true), preamp(1.0), playIndex(0), playTick(0), playTime(0),
+  lengthCache(-1), currentInstrument(defaultInst), pendingHead(0), bendRange(2), releaseTime(0), transpose(0), tuning(0),
+  volume(1.0), pan(0.5), stopped(false), psgNotesPlayed(0)
 {
+  saveCheckpoint();
+}
+
+void TrackData::decodeEvents() const
+{
+  if (decoded) {
+    return;
+  }
+  std::shared_ptr<const DecodedTrack> track = song->rom->decodedTrack(addr);
+  if (!track) {
+    std::shared_ptr<DecodedTrack> result(new DecodedTrack);
+    try {
+      decode(result->events, nullptr);
+    } catch (...) {
+      result->events.clear();
+      result->error = std::current_exception();
+    }
+    track = song->rom->storeDecodedTrack(addr, result);
+  }
+  if (track->error) {
+    std::rethrow_exception(track->error);
+  }
+  decoded = track;
+}
+
+const std::vector<Mp2kEvent>& TrackData::events() const
+{
+  decodeEvents();
+  return decoded->events;
+}
+
+void TrackData::decode(std::vector<Mp2kEvent>& events, std::vector<RawEvent>* rawEvents) const
+{
+  // Keyed by the address of each command and the pattern return address
   std::unordered_map<uint64_t, size_t> addrToIndex;
-  std::unordered_map<size_t, uint64_t> indexToAddr;
   const ROMFile& r = *song->rom;
   uint32_t pos = addr;
   uint8_t running = 0;
-  uint8_t instrument = 0, noteVel = 127, noteLen = 96;
+  uint8_t noteVel = 127;
   RawEvent raw;
   int8_t noteKey = 60;
-  uint32_t argAddr, argPos;
-  uint32_t timestamp = 0;
   uint32_t returnAddr = 0;
   uint32_t repeatAddr = 0;
   uint8_t repeatCount = 1;
-  int ts = 0;
+  events.clear();
   while (true) {
     raw.addr = pos;
     raw.opcode = r[pos];
-    raw.args.clear();
+    raw.numArgs = 0;
     int eventSize = EventType::size(raw.opcode);
     uint32_t argOffset = 1;
     if (eventSize == 0) {
@@ -171,41 +209,39 @@ TrackData::TrackData(SongData* song, int index, uint32_t addr, MpInstrument* def
     }
     if (raw.opcode == EventType::MEMACC) {
       for (int i = 1; i < 4; i++) {
-        raw.args.push_back(r[pos + i]);
+        raw.addArg(r[pos + i]);
       }
       if (eventSize > 4) {
-        raw.args.push_back(r.read<uint32_t>(pos + 4));
+        raw.addArg(r.read<uint32_t>(pos + 4));
       }
     } else if (raw.opcode == EventType::GOTO || raw.opcode == EventType::PATT) {
-      raw.args.push_back(r.readPointer(pos + 1, false));
+      raw.addArg(r.readPointer(pos + 1, false));
     } else if (raw.opcode == EventType::REPT) {
-      raw.args.push_back(r[pos + 1]);
-      raw.args.push_back(r.readPointer(pos + 2, false));
+      raw.addArg(r[pos + 1]);
+      raw.addArg(r.readPointer(pos + 2, false));
     } else if (eventSize > argOffset) {
       for (int i = argOffset; i < eventSize; i++) {
-        raw.args.push_back(r[pos + i]);
+        raw.addArg(r[pos + i]);
       }
     }
-    rawEvents.push_back(raw);
+    if (rawEvents) {
+      rawEvents->push_back(raw);
+    }
     pos += eventSize;
     Mp2kEvent ev;
-    ev.raw = raw;
-    ev.effAddr = (uint64_t(returnAddr) << 32) | raw.addr;
+    ev.value = 0;
+    ev.param = 0;
     ev.duration = 0;
-    size_t index = events.size();
-    addrToIndex[ev.effAddr] = index;
-    if (!indexToAddr.count(index)) {
-      indexToAddr[index] = ev.effAddr;
-    }
+    uint64_t effAddr = (uint64_t(returnAddr) << 32) | raw.addr;
+    addrToIndex[effAddr] = events.size();
     if (raw.opcode < 0xB1) {
       ev.type = Mp2kEvent::Rest;
       ev.duration = noteLength[raw.opcode - 0x81 + 2];
-      ts += ev.duration;
       events.push_back(ev);
     } else if (raw.opcode >= 0xCE) { // EOT / TIE / NOTE
       running = raw.opcode;
       uint8_t noteLen = noteLength[raw.opcode - 0xCE];
-      int numArgs = raw.args.size();
+      int numArgs = raw.numArgs;
       if (numArgs > 0) noteKey = raw.args[0];
       if (numArgs > 1) noteVel = raw.args[1];
       if (numArgs > 2) noteLen += raw.args[2];
@@ -228,12 +264,11 @@ TrackData::TrackData(SongData* song, int index, uint32_t addr, MpInstrument* def
         return;
       case GOTO:
         {
-          uint64_t effAddr = (uint64_t(returnAddr) << 32) | raw.args[0];
-          if (addrToIndex.count(effAddr)) {
+          uint64_t target = (uint64_t(returnAddr) << 32) | raw.args[0];
+          if (addrToIndex.count(target)) {
             // Jump to an address we've already seen
-            hasLoop = true;
             ev.type = Mp2kEvent::Goto;
-            ev.value = addrToIndex.at(effAddr);
+            ev.value = addrToIndex.at(target);
             events.push_back(ev);
             return;
           }
@@ -317,26 +352,186 @@ TrackData::~TrackData()
 
 void TrackData::internalReset()
 {
-  playIndex = 0;
-  playTime = 0;
-  secPerTick = 1.0 / 60.0;
+  restoreCheckpoint(checkpoints.front());
+}
+
+TrackData::Checkpoint TrackData::makeCheckpoint(const TrackData* track)
+{
+  Checkpoint checkpoint;
+  checkpoint.playIndex = track->playIndex;
+  checkpoint.playTick = track->playTick;
+  checkpoint.playTime = track->playTime;
+  checkpoint.currentInstrument = track->currentInstrument;
+  track->activeNotes.forEach([&checkpoint](size_t noteID, const ActiveNote& note) {
+    checkpoint.activeNotes.emplace_back(noteID, note);
+  });
+  checkpoint.bendRange = track->bendRange;
+  checkpoint.releaseTime = track->releaseTime;
+  checkpoint.transpose = track->transpose;
+  checkpoint.tuning = track->tuning;
+  checkpoint.volume = track->volume;
+  checkpoint.pan = track->pan;
+  checkpoint.stopped = track->stopped;
+  checkpoint.loopPasses = track->loopCheckpoints.size();
+  checkpoint.psgNotesPlayed = track->psgNotesPlayed;
+  return checkpoint;
+}
+
+bool TrackData::stopNote(ActiveNote& note, uint16_t velocity, double time)
+{
+  if (velocity > 0 || note.endTime == 0 || note.endTime > time) {
+    // note replaced with another note or past its release time
+    return true;
+  }
+  if (!note.released) {
+    note.released = true;
+    note.endTime = time + (note.endTime - note.releaseTime);
+    note.releaseTime = time;
+  }
+  return false;
+}
+
+void TrackData::saveCheckpoint()
+{
+  checkpoints.push_back(makeCheckpoint(this));
+}
+
+bool TrackData::sameLoopState(const Checkpoint& lhs, const Checkpoint& rhs)
+{
+  if (lhs.playIndex != rhs.playIndex || lhs.currentInstrument != rhs.currentInstrument ||
+      lhs.bendRange != rhs.bendRange || lhs.releaseTime != rhs.releaseTime || lhs.transpose != rhs.transpose ||
+      lhs.tuning != rhs.tuning || lhs.volume != rhs.volume || lhs.pan != rhs.pan || lhs.stopped != rhs.stopped) {
+    return false;
+  }
+  // Compare the notes that are still sounding, relative to the loop point.
+  static const double EPSILON = 1e-6;
+  auto sounding = [](const Checkpoint& checkpoint) {
+    std::vector<std::pair<uint8_t, ActiveNote>> notes;
+    for (const auto& note : checkpoint.activeNotes) {
+      // Tied notes have no release time until they're ended.
+      bool tied = note.second.releaseTime == 0;
+      if (tied || note.second.endTime > checkpoint.playTime) {
+        notes.push_back(note);
+        notes.back().second.startTime -= checkpoint.playTime;
+        if (!tied) {
+          notes.back().second.releaseTime -= checkpoint.playTime;
+          notes.back().second.endTime -= checkpoint.playTime;
+        }
+      }
+    }
+    std::sort(notes.begin(), notes.end(), [](const std::pair<uint8_t, ActiveNote>& a, const std::pair<uint8_t, ActiveNote>& b) {
+      return a.first < b.first;
+    });
+    return notes;
+  };
+  std::vector<std::pair<uint8_t, ActiveNote>> lhsNotes = sounding(lhs), rhsNotes = sounding(rhs);
+  if (lhsNotes.size() != rhsNotes.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < lhsNotes.size(); i++) {
+    const ActiveNote& a = lhsNotes[i].second;
+    const ActiveNote& b = rhsNotes[i].second;
+    if (lhsNotes[i].first != rhsNotes[i].first || a.released != b.released || std::fabs(a.startTime - b.startTime) > EPSILON ||
+        std::fabs(a.releaseTime - b.releaseTime) > EPSILON || std::fabs(a.endTime - b.endTime) > EPSILON) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TrackData::restoreCheckpoint(const Checkpoint& checkpoint)
+{
+  playIndex = checkpoint.playIndex;
+  playTick = checkpoint.playTick;
+  playTime = checkpoint.playTime;
+  currentInstrument = checkpoint.currentInstrument;
+  activeNotes.clear();
+  for (const auto& note : checkpoint.activeNotes) {
+    activeNotes.set(note.first, note.second);
+  }
+  bendRange = checkpoint.bendRange;
+  releaseTime = checkpoint.releaseTime;
+  transpose = checkpoint.transpose;
+  tuning = checkpoint.tuning;
+  volume = checkpoint.volume;
+  pan = checkpoint.pan;
+  stopped = checkpoint.stopped;
+  if (loopCheckpoints.size() > checkpoint.loopPasses) {
+    loopCheckpoints.resize(checkpoint.loopPasses);
+  }
+  psgNotesPlayed = checkpoint.psgNotesPlayed;
+  pendingEvents.clear();
+  pendingHead = 0;
+}
+
+void TrackData::seekTo(double time)
+{
+  auto iter = std::upper_bound(checkpoints.begin(), checkpoints.end(), time, [](double time, const Checkpoint& checkpoint) {
+    return time < checkpoint.playTime;
+  });
+  const Checkpoint& nearest = iter == checkpoints.begin() ? checkpoints.front() : *(iter - 1);
+  if (playTime > time || playTime < nearest.playTime) {
+    restoreCheckpoint(nearest);
+  }
+  // Anything still queued happened before the current position.
+  pendingEvents.clear();
+  pendingHead = 0;
+  while (playTime < time && !isFinished()) {
+    queueEvents(time);
+    pendingEvents.clear();
+    pendingHead = 0;
+  }
+  // The channel settings sent along the way were dropped, so send the current ones.
+  if (currentInstrument) {
+    pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, 'inst', uint64_t(currentInstrument->addr)));
+    pendingEvents.back()->timestamp = time;
+  }
+  pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, AudioNode::Pan, pan));
+  pendingEvents.back()->timestamp = time;
+  pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, AudioNode::Gain, 2 * volume));
+  pendingEvents.back()->timestamp = time;
+}
+
+bool TrackData::findLoop(uint64_t& start, uint64_t& end) const
+{
+  const std::vector<Mp2kEvent>& events = this->events();
+  std::vector<uint64_t> ticks(events.size(), 0);
+  uint64_t tick = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    const Mp2kEvent& ev = events[i];
+    ticks[i] = tick;
+    if (ev.type == Mp2kEvent::Rest) {
+      tick += ev.duration;
+    } else if (ev.type == Mp2kEvent::Goto) {
+      start = ticks[ev.value];
+      end = tick;
+      return end > start;
+    } else if (ev.type == Mp2kEvent::Stop) {
+      break;
+    }
+  }
+  return false;
 }
 
 double TrackData::length() const
 {
+  uint64_t loopStart, loopEnd;
+  if (lengthCache < 0 && song->loopCount > 0 && findLoop(loopStart, loopEnd)) {
+    lengthCache = song->loopEndTime(song->loopCount - 1) + song->fadeTime;
+  }
   if (lengthCache < 0) {
-    double spt = 1.0 / 60.0;
+    const std::vector<Mp2kEvent>& events = this->events();
+    const TempoMap& tempo = song->tempoMap();
     double lastEnd = 0;
-    double time = 0;
+    uint64_t tick = 0;
     int lastIndex = events.size();
     for (int index = 0; index < lastIndex; index++) {
       const Mp2kEvent& ev = events[index];
       if (ev.type == Mp2kEvent::Rest) {
-        time += ev.duration * spt;
-        spt = song->tickLengthAt(time);
+        tick += ev.duration;
       } else if (ev.type == Mp2kEvent::Note && ev.duration != 0xFF) {
         // TODO: release trails
-        double end = time + ev.duration * spt;
+        double end = tempo.tickToTime(tick + ev.duration);
         if (end > lastEnd) {
           lastEnd = end;
         }
@@ -345,6 +540,7 @@ double TrackData::length() const
         break;
       }
     }
+    double time = tempo.tickToTime(tick);
     lengthCache = (time > lastEnd ? time : lastEnd) + 1;
   }
   return lengthCache;
@@ -352,37 +548,52 @@ double TrackData::length() const
 
 bool TrackData::isFinished() const
 {
-  return stopped || playIndex >= events.size() || playTime > length();
+  decodeEvents();
+  return stopped || playIndex >= decoded->events.size() || playTime > length();
 }
 
-double SongData::tickLengthAt(double timestamp) const
+std::shared_ptr<SequenceEvent> TrackData::readNextEvent()
 {
-  for (int i = tempos.size() - 1; i >= 0; --i) {
-    if (tempos[i].first <= timestamp) {
-      return tempos[i].second;
-    }
+  if (pendingHead == pendingEvents.size()) {
+    queueEvents(HUGE_VAL);
+  }
+  if (pendingHead == pendingEvents.size()) {
+    return nullptr;
   }
-  return 1.0 / 60.0;
+  std::shared_ptr<SequenceEvent> result = std::move(pendingEvents[pendingHead++]);
+  if (pendingHead == pendingEvents.size()) {
+    // Drained: start over at the front, keeping the storage
+    pendingEvents.clear();
+    pendingHead = 0;
+  }
+  return result;
 }
 
-std::shared_ptr<SequenceEvent> TrackData::readNextEvent()
+void TrackData::queueEvents(double until)
 {
   bool didGoto = false;
-  while (!isFinished() && !pendingEvents.size()) {
-    //std::cerr << trackIndex << ":" << playIndex << "@" << playTime << "\t" << events[playIndex].raw.render() << std::endl;
-    const Mp2kEvent& event = events[playIndex++];
-    secPerTick = song->tickLengthAt(playTime);
-    double duration = event.duration == 0xFF ? -1 : event.duration * secPerTick;
+  const TempoMap& tempo = song->tempoMap();
+  while (!isFinished() && pendingHead == pendingEvents.size() && playTime < until) {
+    if (playTime >= checkpoints.back().playTime + CHECKPOINT_INTERVAL) {
+      // Nothing is queued, so this is a clean place to resume from.
+      saveCheckpoint();
+    }
+    const Mp2kEvent& event = decoded->events[playIndex++];
+    double duration = event.duration == 0xFF ? -1 : tempo.tickToTime(playTick + event.duration) - playTime;
     if (event.type == Mp2kEvent::Stop) {
       stopped = true;
     } else if (event.type == Mp2kEvent::Rest) {
-      playTime += duration;
+      playTick += event.duration;
+      playTime = tempo.tickToTime(playTick);
     } else if (event.type == Mp2kEvent::Goto) {
       if (didGoto) {
         // loop never produces an event: abort
-        playIndex = events.size();
+        playIndex = decoded->events.size();
         //std::cerr << "abort" << std::endl;
       } else {
+        if (song->loopCount > 0) {
+          loopCheckpoints.push_back(makeCheckpoint(this));
+        }
         playIndex = event.value;
         //std::cerr << "goto" << std::endl;
         didGoto = true;
@@ -391,9 +602,7 @@ std::shared_ptr<SequenceEvent> TrackData::readNextEvent()
       switch (event.param) {
         using namespace EventType;
         case TEMPO:
-          // simplification of 1.0 / (value / 75.0 * 60.0)
-          secPerTick = 0.8 * 1.6 / event.value; // TODO: fix base rate
-          song->tempos.emplace_back(playTime, secPerTick);
+          // Already accounted for by the song's tempo map
           break;
         case KEYSH:
           transpose = event.value;
@@ -405,19 +614,20 @@ std::shared_ptr<SequenceEvent> TrackData::readNextEvent()
           {
             int instID = int(event.value);
             currentInstrument = song->getInstrument(instID);
-            std::cerr << trackIndex << ": Using instrument " << std::dec << instID << " (" << (currentInstrument ? (int)currentInstrument->type : -1) << ") " << std::endl;
+            MP2K_TRACE(Debug, Trace::InstrumentChange, trackIndex, instID, currentInstrument ? int(currentInstrument->type) : -1);
             if (currentInstrument) {
-              pendingEvents.emplace_back(new ChannelEvent('inst', uint64_t(currentInstrument->addr)));
+              pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, 'inst', uint64_t(currentInstrument->addr)));
               releaseTime = currentInstrument->release;
             }
           }
           break;
         case PAN:
-          pendingEvents.emplace_back(new ChannelEvent(AudioNode::Pan, event.value / 128.0));
+          pan = event.value / 128.0;
+          pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, AudioNode::Pan, pan));
           pendingEvents.back()->timestamp = playTime;
           break;
         case VOL:
-          pendingEvents.emplace_back(new ChannelEvent(AudioNode::Gain, 2 * preamp * event.value / 127.0));
+          pendingEvents.push_back(makePooled<ChannelEvent>(song->eventPool, AudioNode::Gain, 2 * preamp * event.value / 127.0));
           pendingEvents.back()->timestamp = playTime;
           volume = preamp * event.value / 127.0;
           break;
@@ -427,96 +637,121 @@ std::shared_ptr<SequenceEvent> TrackData::readNextEvent()
         case BEND:
           {
             double bend = noteToFreq(69 + bendRange * (event.value - 64.0) / 64.0) / 440.0;
-            for (const auto& it : activeNotes) {
-              ModulatorEvent* modEvent = new ModulatorEvent(it.second.playbackID, 'bend', bend);
+            activeNotes.forEach([this, bend](size_t, const ActiveNote& note) {
+              std::shared_ptr<ModulatorEvent> modEvent = makePooled<ModulatorEvent>(song->eventPool, note.playbackID, 'bend', bend);
               modEvent->timestamp = playTime;
               pendingEvents.emplace_back(modEvent);
-            }
+            });
           }
           break;
         default:
           // TODO
-          std::cerr << "unknown param " << std::hex << (int)event.param << std::dec << std::endl;
+          MP2K_TRACE(Warning, Trace::UnknownParam, trackIndex, event.param);
           break;
       }
     } else if (event.type == Mp2kEvent::Note && currentInstrument) {
       uint8_t note = event.param + transpose;
-      // PSG instruments are mutually exclusive
-      bool psg = currentInstrument->type & 0x7;
-      uint8_t noteID = psg ? 0x80 + currentInstrument->type : note;
-      auto& active = psg ? song->activePsg : activeNotes;
-      auto iter = active.find(noteID);
-      if (iter != active.end() && (psg || iter->second.releaseTime == 0 || iter->second.endTime > playTime)) {
-        KillEvent* killEvent = new KillEvent(iter->second.playbackID, playTime);
-        if (event.value > 0 || iter->second.endTime == 0 || iter->second.endTime > playTime) {
-          // note replaced with another note or past its release time
+      // Each PSG channel only plays one note at a time, across all tracks
+      int psgChannel = currentInstrument->type & 0x7;
+      uint8_t noteID = psgChannel ? 0x80 + psgChannel : note;
+      ActiveNote* current = psgChannel ? song->activePsg.find(psgChannel - 1) : activeNotes.find(noteID);
+      if (current && (psgChannel || current->releaseTime == 0 || current->endTime > playTime)) {
+        std::shared_ptr<KillEvent> killEvent = makePooled<KillEvent>(song->eventPool, current->playbackID, playTime);
+        if (stopNote(*current, event.value, playTime)) {
           killEvent->immediate = true;
-          active.erase(iter);
-        } else if (!iter->second.released) {
-          iter->second.released = true;
-          iter->second.endTime = playTime + (iter->second.endTime - iter->second.releaseTime);
-          iter->second.releaseTime = playTime;
+          if (psgChannel) {
+            song->activePsg.erase(psgChannel - 1);
+          } else {
+            activeNotes.erase(noteID);
+          }
         }
         pendingEvents.emplace_back(killEvent);
       }
+      PsgNote psgNote = { playTime, psgChannel - 1, event.value, false, {} };
       if (duration != 0) {
-        BaseNoteEvent* noteEvent = currentInstrument->makeEvent(volume, note + tuning, event.value, duration);
+        std::shared_ptr<BaseNoteEvent> noteEvent = currentInstrument->makeEvent(song->eventPool, volume, note + tuning, event.value, duration);
         if (noteEvent) {
           noteEvent->timestamp = playTime;
           double noteReleaseTime = duration >= 0 ? playTime + duration : 0;
           double endTime = noteReleaseTime + releaseTime;
-          active[noteID] = (ActiveNote){
+          ActiveNote active = {
             noteEvent->playbackID,
+            playTime,
             noteReleaseTime,
             endTime,
             false,
           };
-          if (psg) {
-            activeNotes[noteID] = active[noteID];
+          if (psgChannel) {
+            song->activePsg.set(psgChannel - 1, active);
+            psgNote.started = true;
+            psgNote.note = active;
           }
+          activeNotes.set(noteID, active);
           pendingEvents.emplace_back(noteEvent);
         }
       }
+      if (psgChannel) {
+        // A replay after seeking plays the same notes again
+        if (psgNotesPlayed < psgNotes.size()) {
+          psgNotes[psgNotesPlayed] = psgNote;
+        } else {
+          psgNotes.push_back(psgNote);
+        }
+        psgNotesPlayed++;
+      }
     } else if (event.type == Mp2kEvent::Note) {
-      std::cerr << "note without valid instrument" << std::endl;
+      MP2K_TRACE(Warning, Trace::NoteWithoutInstrument, trackIndex, event.param);
     }
   }
   if (isFinished()) {
-    while (activeNotes.size()) {
-      auto iter = activeNotes.begin();
-      KillEvent* killEvent = new KillEvent(iter->second.playbackID, playTime);
+    activeNotes.forEach([this](size_t, const ActiveNote& note) {
+      std::shared_ptr<KillEvent> killEvent = makePooled<KillEvent>(song->eventPool, note.playbackID, playTime);
       killEvent->immediate = true;
       pendingEvents.emplace_back(killEvent);
-      activeNotes.erase(iter);
-    }
+    });
+    activeNotes.clear();
   }
-  if (pendingEvents.size()) {
-    auto result = pendingEvents.at(0);
-    pendingEvents.erase(pendingEvents.begin());
-    return result;
-  }
-  return nullptr;
 }
 
 void TrackData::showParsed(std::ostream& out)
 {
   out << "Track " << trackIndex << ":" << std::endl;
+  std::vector<Mp2kEvent> decoded;
+  std::vector<RawEvent> rawEvents;
+  decode(decoded, &rawEvents);
   for (const RawEvent& raw : rawEvents) {
     out << "\t" << raw.render() << std::endl;
   }
 }
 
 SongData::SongData(const ROMFile* rom, uint32_t addr)
-: BaseSequence(rom->context()), rom(rom), addr(addr), hasLoop(false), instruments(rom, rom->readPointer(addr + 4))
+: BaseSequence(rom->context()), rom(rom), addr(addr), hasLoop(false), instruments(rom, rom->readPointer(addr + 4)), eventPool(new EventPool),
+  loopCount(0), fadeTime(0)
 {
   int numTracks = rom->read<uint8_t>(addr);
+  std::vector<uint32_t> trackAddrs;
+  for (int i = 0; i < numTracks; i++) {
+    trackAddrs.push_back(rom->readPointer(addr + 8 + i * 4, false));
+  }
+  addTracks(trackAddrs);
+}
+
+SongData::SongData(const ROMFile* rom, uint32_t addr, const InstrumentData& instruments, const std::vector<uint32_t>& trackAddrs)
+: BaseSequence(rom->context()), rom(rom), addr(addr), instruments(instruments), eventPool(new EventPool),
+  loopCount(0), fadeTime(0), hasLoop(false)
+{
+  addTracks(trackAddrs);
+}
+
+void SongData::addTracks(const std::vector<uint32_t>& trackAddrs)
+{
   MpInstrument* defaultInst = nullptr;
   if (rom->synthContext()) {
     int defaultInstId = rom->synthContext()->instrumentID(0);
     defaultInst = static_cast<MpInstrument*>(rom->synthContext()->getInstrument(defaultInstId));
   }
-  for (int i = 0; i < numTracks; i++) {
-    TrackData* track = new TrackData(this, i, rom->readPointer(addr + 8 + i * 4, false), defaultInst);
+  for (size_t i = 0; i < trackAddrs.size(); i++) {
+    TrackData* track = new TrackData(this, i, trackAddrs[i], defaultInst);
     addTrack(track);
     if (track->hasLoop) {
       hasLoop = true;
@@ -524,11 +759,225 @@ SongData::SongData(const ROMFile* rom, uint32_t addr)
   }
 }
 
+void SongData::decodeAll() const
+{
+  std::vector<std::exception_ptr> errors;
+  decodeSongs({ this }, errors);
+  if (errors[0]) {
+    std::rethrow_exception(errors[0]);
+  }
+}
+
+void SongData::decodeSongs(const std::vector<const SongData*>& songs, std::vector<std::exception_ptr>& errors)
+{
+  std::vector<std::pair<size_t, const TrackData*>> pending;
+  for (size_t i = 0; i < songs.size(); i++) {
+    for (const auto& track : songs[i]->tracks) {
+      if (!track->isDecoded()) {
+        pending.emplace_back(i, track.get());
+      }
+    }
+  }
+  // Keep every track's result so the reported error doesn't depend on timing.
+  std::vector<std::exception_ptr> trackErrors(pending.size());
+  ThreadPool::instance()->parallelFor(pending.size(), 1, [&pending, &trackErrors](size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+      try {
+        pending[i].second->decodeEvents();
+      } catch (...) {
+        trackErrors[i] = std::current_exception();
+      }
+    }
+  });
+  errors.assign(songs.size(), nullptr);
+  for (size_t i = 0; i < pending.size(); i++) {
+    if (trackErrors[i] && !errors[pending[i].first]) {
+      errors[pending[i].first] = trackErrors[i];
+    }
+  }
+}
+
+const TempoMap& SongData::tempoMap() const
+{
+  std::call_once(tempoOnce, [this]{ buildTempoMap(); });
+  return tempo;
+}
+
+static double tempoTickLength(uint16_t value)
+{
+  // simplification of 1.0 / (value / 75.0 * 60.0)
+  return 0.8 * 1.6 / value; // TODO: fix base rate
+}
+
+void SongData::buildTempoMap() const
+{
+  struct Loop {
+    uint64_t start, end;
+    std::vector<std::pair<uint64_t, uint16_t>> changes;
+  };
+  std::vector<std::pair<uint64_t, uint16_t>> changes;
+  std::vector<Loop> loops;
+  for (const auto& track : tracks) {
+    const std::vector<Mp2kEvent>* events;
+    try {
+      events = &track->events();
+    } catch (...) {
+      // The track will report the error itself if it's played.
+      continue;
+    }
+    std::vector<uint64_t> ticks(events->size(), 0);
+    uint64_t tick = 0;
+    for (size_t i = 0; i < events->size(); i++) {
+      const Mp2kEvent& ev = (*events)[i];
+      ticks[i] = tick;
+      if (ev.type == Mp2kEvent::Rest) {
+        tick += ev.duration;
+      } else if (ev.type == Mp2kEvent::Param && ev.param == EventType::TEMPO && ev.value > 0) {
+        changes.emplace_back(tick, ev.value);
+      } else if (ev.type == Mp2kEvent::Goto) {
+        Loop loop{ ticks[ev.value], tick, {} };
+        for (size_t j = ev.value; j < i; j++) {
+          const Mp2kEvent& loopEv = (*events)[j];
+          if (loopEv.type == Mp2kEvent::Param && loopEv.param == EventType::TEMPO && loopEv.value > 0) {
+            loop.changes.emplace_back(ticks[j], loopEv.value);
+          }
+        }
+        if (loop.end > loop.start && !loop.changes.empty()) {
+          loops.push_back(loop);
+        }
+        break;
+      } else if (ev.type == Mp2kEvent::Stop) {
+        break;
+      }
+    }
+  }
+
+  uint64_t loopStart = 0, loopEnd = 0;
+  if (!loops.empty()) {
+    // Repeat the looping tempo changes once. The second pass is the one that
+    // repeats forever, since it starts with the tempo that was in effect at
+    // the end of the first. Only tracks that loop over the same span as the
+    // first one can be folded this way.
+    uint64_t length = loops[0].end - loops[0].start;
+    for (const Loop& loop : loops) {
+      if (loop.start == loops[0].start && loop.end == loops[0].end) {
+        for (const auto& change : loop.changes) {
+          changes.emplace_back(change.first + length, change.second);
+        }
+      }
+    }
+    loopStart = loops[0].end;
+    loopEnd = loops[0].end + length;
+  }
+
+  // Changes at the same tick take effect in track order.
+  std::stable_sort(changes.begin(), changes.end(), [](const std::pair<uint64_t, uint16_t>& lhs, const std::pair<uint64_t, uint16_t>& rhs) {
+    return lhs.first < rhs.first;
+  });
+  for (const auto& change : changes) {
+    tempo.addChange(change.first, tempoTickLength(change.second));
+  }
+  if (loopEnd) {
+    tempo.setLoop(loopStart, loopEnd);
+  }
+}
+
+void SongData::seekTo(double time)
+{
+  // PSG channels are shared, so the tracks can't work out which note holds
+  // each of them on their own. Play every track's PSG notes up to this point
+  // back in time order instead.
+  std::vector<const TrackData::PsgNote*> psgNotes;
+  for (const auto& track : tracks) {
+    track->seekTo(time);
+    for (size_t i = 0; i < track->psgNotesPlayed; i++) {
+      psgNotes.push_back(&track->psgNotes[i]);
+    }
+  }
+  std::stable_sort(psgNotes.begin(), psgNotes.end(), [](const TrackData::PsgNote* lhs, const TrackData::PsgNote* rhs) {
+    return lhs->time < rhs->time;
+  });
+  activePsg.clear();
+  for (const TrackData::PsgNote* psgNote : psgNotes) {
+    TrackData::ActiveNote* current = activePsg.find(psgNote->channel);
+    if (current && TrackData::stopNote(*current, psgNote->velocity, psgNote->time)) {
+      activePsg.erase(psgNote->channel);
+    }
+    if (psgNote->started) {
+      activePsg.set(psgNote->channel, psgNote->note);
+    }
+  }
+}
+
 bool SongData::canLoop() const
 {
+  uint64_t start, end;
+  return findLoop(start, end);
+}
+
+void SongData::setLoops(int count, double fade)
+{
+  loopCount = count;
+  fadeTime = fade;
+  for (const auto& track : tracks) {
+    track->lengthCache = -1;
+  }
+}
+
+bool SongData::findLoop(uint64_t& start, uint64_t& end) const
+{
+  for (const auto& track : tracks) {
+    try {
+      if (track->findLoop(start, end)) {
+        return true;
+      }
+    } catch (...) {
+      // An invalid track doesn't play at all
+    }
+  }
   return false;
 }
 
+double SongData::loopEndTime(int pass) const
+{
+  uint64_t start, end;
+  if (!findLoop(start, end)) {
+    return 0;
+  }
+  return tempoMap().tickToTime(end + pass * (end - start));
+}
+
+bool SongData::loopStateRepeats(int pass1, int pass2) const
+{
+  uint64_t start, end;
+  if (!findLoop(start, end)) {
+    return false;
+  }
+  double firstTime = loopEndTime(pass1 < pass2 ? pass1 : pass2);
+  for (const auto& track : tracks) {
+    uint64_t trackStart, trackEnd;
+    bool loops = false;
+    try {
+      loops = track->findLoop(trackStart, trackEnd);
+    } catch (...) {
+      continue;
+    }
+    if (!loops) {
+      // Tracks that don't loop must be over by then, release trails included.
+      if (track->length() > firstTime) {
+        return false;
+      }
+    } else if (trackStart != start || trackEnd != end) {
+      return false;
+    } else if (int(track->loopCheckpoints.size()) <= pass1 || int(track->loopCheckpoints.size()) <= pass2) {
+      return false;
+    } else if (!TrackData::sameLoopState(track->loopCheckpoints[pass1], track->loopCheckpoints[pass2])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 MpInstrument* SongData::getInstrument(uint8_t id) const
 {
   if (id >= 128) {
@@ -4,21 +4,31 @@
 #include "seq/isequence.h"
 #include "seq/itrack.h"
 #include "instrumentdata.h"
-#include <unordered_map>
+#include "tempomap.h"
+#include "voicetable.h"
+#include <exception>
+#include <mutex>
 class ROMFile;
 class SongData;
 class SynthContext;
+class EventPool;
 
 struct RawEvent {
+  static constexpr int MAX_ARGS = 4;
+
   uint32_t addr;
   uint8_t opcode;
-  std::vector<uint32_t> args;
+  uint8_t numArgs;
+  uint32_t args[MAX_ARGS];
 
+  inline void addArg(uint32_t arg) { args[numArgs++] = arg; }
   std::string render() const;
 };
 
+// Decoded events are stored as small fixed-size records. The raw command
+// stream is decoded again on demand for display.
 struct Mp2kEvent {
-  enum Type {
+  enum Type : uint8_t {
     Note,
     Rest,
     Param,
@@ -26,19 +36,25 @@ struct Mp2kEvent {
     Stop,
   };
 
-  uint64_t effAddr;
-  Type type;
   uint16_t value;
+  Type type;
   uint8_t param;
   uint8_t duration;
-  RawEvent raw;
+};
+
+// The decoded form of the track starting at a given address. These are
+// immutable once created and shared by every song that uses the track.
+struct DecodedTrack {
+  std::vector<Mp2kEvent> events;
+  // Set instead if the track couldn't be decoded
+  std::exception_ptr error;
 };
 
 class TrackData : public ITrack {
 public:
   struct ActiveNote {
     uint64_t playbackID;
-    double releaseTime, endTime;
+    double startTime, releaseTime, endTime;
     bool released;
   };
 
@@ -57,30 +73,107 @@ public:
 
   void showParsed(std::ostream& out);
 
+  // Tracks are decoded the first time their events are needed. This forces it
+  // to happen now, and throws if the track data is invalid.
+  void decodeEvents() const;
+  inline bool isDecoded() const { return bool(decoded); }
+  // Decodes the track if necessary.
+  const std::vector<Mp2kEvent>& events() const;
+
+  // Moves the play position to `time` as if the track had been played up to
+  // that point, discarding the events in between. Snapshots of the track's
+  // state are recorded every CHECKPOINT_INTERVAL seconds as it plays, so only
+  // the part after the nearest one needs to be replayed.
+  void seekTo(double time);
+  static constexpr double CHECKPOINT_INTERVAL = 5.0;
+
+  // Finds the loop in ticks. Returns false if the track doesn't loop.
+  bool findLoop(uint64_t& start, uint64_t& end) const;
+
 protected:
+  // Walks the command stream, following jumps and pattern calls. If `rawEvents`
+  // is not null, every command visited is also appended to it.
+  void decode(std::vector<Mp2kEvent>& events, std::vector<RawEvent>* rawEvents) const;
+
   virtual std::shared_ptr<SequenceEvent> readNextEvent();
   virtual void internalReset();
+  // Plays decoded events until something is queued, the track ends, or the
+  // play position reaches `until`.
+  void queueEvents(double until);
+
+  // A note played on a PSG channel. `note` is only set if one was started.
+  struct PsgNote {
+    double time;
+    int channel;
+    uint16_t velocity;
+    bool started;
+    ActiveNote note;
+  };
+  // Ends a note when another one is played in its place. Returns true if it
+  // has to be cut off immediately; otherwise it's released.
+  static bool stopNote(ActiveNote& note, uint16_t velocity, double time);
+
+  struct Checkpoint {
+    size_t playIndex;
+    uint64_t playTick;
+    double playTime;
+    MpInstrument* currentInstrument;
+    std::vector<std::pair<uint8_t, ActiveNote>> activeNotes;
+    double bendRange;
+    double releaseTime;
+    uint8_t transpose;
+    double tuning;
+    double volume;
+    double pan;
+    bool stopped;
+    size_t loopPasses;
+    size_t psgNotesPlayed;
+  };
+  void saveCheckpoint();
+  void restoreCheckpoint(const Checkpoint& checkpoint);
+  static Checkpoint makeCheckpoint(const TrackData* track);
+  // True if the track will play the same way from both states.
+  static bool sameLoopState(const Checkpoint& lhs, const Checkpoint& rhs);
 
   size_t playIndex;
+  uint64_t playTick;
   double playTime;
-  double secPerTick;
   mutable double lengthCache;
   MpInstrument* currentInstrument;
-  std::vector<RawEvent> rawEvents;
-  std::vector<Mp2kEvent> events;
+  mutable std::shared_ptr<const DecodedTrack> decoded;
+  // Consumed from pendingHead onward, and cleared once drained
   std::vector<std::shared_ptr<SequenceEvent>> pendingEvents;
-  std::unordered_map<uint8_t, ActiveNote> activeNotes;
+  size_t pendingHead;
+  // Keyed by note number. Notes on PSG channels are also kept here, keyed by
+  // 0x80 plus the channel number.
+  VoiceTable<ActiveNote, 256> activeNotes;
   double bendRange;
   double releaseTime;
   uint8_t transpose;
   double tuning;
   double volume;
+  double pan;
   bool stopped : 1;
+  // Ordered by time. The first one is the initial state.
+  std::vector<Checkpoint> checkpoints;
+  // The state each time the loop point was reached, if the song is set to loop
+  std::vector<Checkpoint> loopCheckpoints;
+  // Every note the track has played on a PSG channel, in order, so the
+  // channels can be rebuilt after seeking. See SongData::seekTo().
+  std::vector<PsgNote> psgNotes;
+  // How many of psgNotes have been played since the last reset
+  size_t psgNotesPlayed;
+
+  friend class SongData;
 };
 
 class SongData : public BaseSequence<TrackData> {
 public:
   SongData(const ROMFile* rom, uint32_t addr);
+  // For songs restored from a compiled song file. The instruments must already
+  // be registered with the ROM's synth context. Songs that are only analyzed
+  // may use an empty instrument table instead.
+  SongData(const ROMFile* rom, uint32_t addr, const InstrumentData& instruments, const std::vector<uint32_t>& trackAddrs);
   SongData(const SongData& other) = delete;
   SongData(SongData&& other) = delete;
   SongData& operator=(const SongData& other) = delete;
@@ -89,19 +182,56 @@ public:
   virtual bool canLoop() const;
   MpInstrument* getInstrument(uint8_t id) const;
 
+  // Decodes every track. Throws if any of them is invalid.
+  void decodeAll() const;
+
+  // Decodes the tracks of several songs in parallel. Sets errors[i] to the
+  // first invalid track's exception if songs[i] can't be decoded. Songs must
+  // already be constructed, since instruments are registered as they load.
+  static void decodeSongs(const std::vector<const SongData*>& songs, std::vector<std::exception_ptr>& errors);
+
   const ROMFile* const rom;
   const uint32_t addr;
   InstrumentData instruments;
+  // The tracks' sequence events are allocated from here.
+  std::shared_ptr<EventPool> eventPool;
 
   void showParsed(std::ostream& out);
 
-  std::vector<std::pair<double, double>> tempos;
-  std::unordered_map<uint8_t, TrackData::ActiveNote> activePsg;
-
-  double tickLengthAt(double timestamp) const;
+  // The note playing on each PSG channel, from whichever track played it last.
+  VoiceTable<TrackData::ActiveNote, 4> activePsg;
+
+  // Seeks every track. See TrackData::seekTo().
+  void seekTo(double time);
+
+  // Makes looping tracks play their loop `count` times, followed by a fade
+  // lasting `fadeTime` seconds. If `count` is 0, they play to the first loop
+  // point as usual. Call this before playback starts.
+  void setLoops(int count, double fadeTime);
+  int loopCount;
+  double fadeTime;
+
+  // The loop shared by the song's tracks, in ticks, taken from the first track
+  // that loops. Returns false if no track loops.
+  bool findLoop(uint64_t& start, uint64_t& end) const;
+  // The time at which the song reaches the end of its loop for the given pass,
+  // starting from 0.
+  double loopEndTime(int pass) const;
+  // True if every track was in the same state at the ends of both passes, so
+  // the song will sound the same after each of them.
+  bool loopStateRepeats(int pass1, int pass2) const;
+
+  // Tempo changes apply to every track at once, so the map is built from all
+  // of the tracks the first time it's needed and shared by them afterward.
+  const TempoMap& tempoMap() const;
 
 private:
+  void addTracks(const std::vector<uint32_t>& trackAddrs);
+  void buildTempoMap() const;
+
   bool hasLoop;
+  mutable std::once_flag tempoOnce;
+  mutable TempoMap tempo;
 };
 
 #endif
@@ -0,0 +1,103 @@
+#include "soundengine.h"
+#include "rombuffer.h"
+#include <cstring>
+
+// m4aSongNumStart as built by the stock m4a library:
+//   push {lr}; lsl r0, #16; ldr r2, =gMPlayTable; ldr r1, =gSongTable; lsr r0, #13;
+//   add r0, r1; ldrh r3, [r0, #4]; lsl r1, r3, #1; add r1, r3; lsl r1, #2; add r1, r2;
+//   ldr r2, [r1]; ldr r1, [r0]; mov r0, r2; bl MPlayStart
+static const uint8_t selectSongCode[] = {
+  0x00, 0xB5, 0x00, 0x04, 0x07, 0x4A, 0x08, 0x49,
+  0x40, 0x0B, 0x40, 0x18, 0x83, 0x88, 0x59, 0x00,
+  0xC9, 0x18, 0x89, 0x00, 0x89, 0x18, 0x0A, 0x68,
+  0x01, 0x68, 0x10, 0x1C, 0x00, 0xF0,
+};
+
+// Offset of the `ldr r1, =gSongTable` instruction and its immediate
+static const uint32_t SONG_TABLE_LDR = 6;
+static const uint32_t SONG_TABLE_IMM = 8 * 4;
+
+// m4aSoundMode sample rates, indexed by SOUND_MODE_FREQ
+static const uint32_t soundModeRates[16] = {
+  0, 5734, 7884, 10512, 13379, 15768, 18157, 21024, 26758, 31536, 36314, 40137, 42048, 0, 0, 0,
+};
+
+// Word offsets before m4aSongNumStart to look for the m4aSoundMode argument,
+// most likely first
+static const int soundModeOffsets[] = { 4, 8, 2, 3, 5, 6, 7, 1, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+static bool isSoundMode(uint32_t mode)
+{
+  if (mode & 0xFF000000) {
+    return false;
+  }
+  int maxChannels = (mode >> 8) & 0xF;
+  int masterVolume = (mode >> 12) & 0xF;
+  int freq = (mode >> 16) & 0xF;
+  int dacBits = 17 - ((mode >> 20) & 0xF);
+  return maxChannels >= 1 && maxChannels <= 12 && masterVolume > 0 && soundModeRates[freq] && dacBits >= 6 && dacBits <= 9;
+}
+
+SoundEngine::SoundEngine()
+: selectSongAddr(0), songTableAddr(0), soundModeAddr(0), soundMode(0), sampleRate(0), maxChannels(0), masterVolume(0), dacBits(0)
+{
+  // initializers only
+}
+
+SoundEngine SoundEngine::detect(const ROMBuffer& rom, uint32_t baseAddr)
+{
+  SoundEngine engine;
+  if (rom.size() < sizeof(selectSongCode) + 64) {
+    return engine;
+  }
+  const uint8_t* start = rom.data();
+  const uint8_t* end = start + rom.size() - sizeof(selectSongCode) - 4;
+  // Search for the second byte, since the first one is zero
+  for (const uint8_t* p = start + 1; p < end; p++) {
+    p = reinterpret_cast<const uint8_t*>(std::memchr(p, selectSongCode[1], end - p));
+    if (!p) {
+      break;
+    }
+    uint32_t addr = (p - 1) - start;
+    if ((addr & 1) || std::memcmp(p - 1, selectSongCode, sizeof(selectSongCode))) {
+      continue;
+    }
+
+    // Thumb PC-relative loads use the word-aligned address of the instruction + 4
+    uint32_t literal = ((addr + SONG_TABLE_LDR + 4) & ~3U) + SONG_TABLE_IMM;
+    if (literal + 4 > rom.size()) {
+      continue;
+    }
+    uint32_t ptr = rom.parseInt<uint32_t>(literal);
+    uint32_t tableAddr = ptr & 0x01FFFFFF;
+    if ((ptr & 0xFE000003) != baseAddr || tableAddr + 8 > rom.size()) {
+      continue;
+    }
+    engine.selectSongAddr = addr;
+    engine.songTableAddr = tableAddr;
+    break;
+  }
+  if (!engine.selectSongAddr) {
+    return engine;
+  }
+
+  uint32_t aligned = engine.selectSongAddr & ~3U;
+  for (int offset : soundModeOffsets) {
+    if (uint32_t(offset * 4) > aligned) {
+      continue;
+    }
+    uint32_t modeAddr = aligned - offset * 4;
+    uint32_t mode = rom.parseInt<uint32_t>(modeAddr);
+    if (!isSoundMode(mode)) {
+      continue;
+    }
+    engine.soundModeAddr = modeAddr;
+    engine.soundMode = mode;
+    engine.maxChannels = (mode >> 8) & 0xF;
+    engine.masterVolume = (mode >> 12) & 0xF;
+    engine.sampleRate = soundModeRates[(mode >> 16) & 0xF];
+    engine.dacBits = 17 - ((mode >> 20) & 0xF);
+    break;
+  }
+  return engine;
+}
@@ -0,0 +1,29 @@
+#ifndef GBAMP2WAV_SOUNDENGINE_H
+#define GBAMP2WAV_SOUNDENGINE_H
+
+#include <cstdint>
+class ROMBuffer;
+
+// Locates the MP2K (m4a) sound driver in a ROM image by searching for the
+// compiled code of m4aSongNumStart, whose literal pool holds the address of
+// the song table. The m4aSoundMode argument stored shortly before it gives the
+// driver's mixing parameters.
+struct SoundEngine {
+  SoundEngine();
+
+  static SoundEngine detect(const ROMBuffer& rom, uint32_t baseAddr);
+
+  // Offsets into the image, or 0 if not found
+  uint32_t selectSongAddr;
+  uint32_t songTableAddr;
+  uint32_t soundModeAddr;
+
+  // Only meaningful if soundModeAddr is set
+  uint32_t soundMode;
+  uint32_t sampleRate;
+  int maxChannels;
+  int masterVolume;
+  int dacBits;
+};
+
+#endif
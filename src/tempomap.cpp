@@ -0,0 +1,83 @@
+#include "tempomap.h"
+#include <algorithm>
+
+TempoMap::TempoMap(double initialTickLength)
+: loopStart(0), loopEnd(0), loopStartTime(0), loopEndTime(0)
+{
+  changes.push_back(Change{ 0, 0, initialTickLength });
+}
+
+void TempoMap::addChange(uint64_t tick, double tickLength)
+{
+  const Change& last = changes.back();
+  if (tick <= last.tick) {
+    changes.back().tickLength = tickLength;
+    return;
+  }
+  double time = last.time + (tick - last.tick) * last.tickLength;
+  changes.push_back(Change{ tick, time, tickLength });
+}
+
+void TempoMap::setLoop(uint64_t start, uint64_t end)
+{
+  if (end <= start) {
+    loopStart = loopEnd = 0;
+    return;
+  }
+  loopStart = start;
+  loopEnd = end;
+  loopStartTime = unfoldedTime(start);
+  loopEndTime = unfoldedTime(end);
+}
+
+const TempoMap::Change& TempoMap::changeAtTick(uint64_t tick) const
+{
+  auto iter = std::upper_bound(changes.begin(), changes.end(), tick, [](uint64_t tick, const Change& change) {
+    return tick < change.tick;
+  });
+  return iter == changes.begin() ? changes.front() : *(iter - 1);
+}
+
+const TempoMap::Change& TempoMap::changeAtTime(double time) const
+{
+  auto iter = std::upper_bound(changes.begin(), changes.end(), time, [](double time, const Change& change) {
+    return time < change.time;
+  });
+  return iter == changes.begin() ? changes.front() : *(iter - 1);
+}
+
+double TempoMap::unfoldedTime(uint64_t tick) const
+{
+  const Change& change = changeAtTick(tick);
+  return change.time + (tick - change.tick) * change.tickLength;
+}
+
+double TempoMap::tickToTime(uint64_t tick) const
+{
+  if (loopEnd && tick >= loopEnd) {
+    uint64_t loops = (tick - loopStart) / (loopEnd - loopStart);
+    tick -= loops * (loopEnd - loopStart);
+    return unfoldedTime(tick) + loops * (loopEndTime - loopStartTime);
+  }
+  return unfoldedTime(tick);
+}
+
+double TempoMap::timeToTick(double time) const
+{
+  uint64_t loops = 0;
+  if (loopEnd && time >= loopEndTime) {
+    loops = (time - loopStartTime) / (loopEndTime - loopStartTime);
+    time -= loops * (loopEndTime - loopStartTime);
+  }
+  const Change& change = changeAtTime(time);
+  double tick = change.tick + (time - change.time) / change.tickLength;
+  return tick < 0 ? 0 : tick + loops * (loopEnd - loopStart);
+}
+
+double TempoMap::tickLength(uint64_t tick) const
+{
+  if (loopEnd && tick >= loopEnd) {
+    tick = loopStart + (tick - loopStart) % (loopEnd - loopStart);
+  }
+  return changeAtTick(tick).tickLength;
+}
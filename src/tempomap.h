@@ -0,0 +1,42 @@
+#ifndef GBAMP2WAV_TEMPOMAP_H
+#define GBAMP2WAV_TEMPOMAP_H
+
+#include <cstdint>
+#include <vector>
+
+// Converts between song ticks and seconds. Each tempo change records the time
+// at which it takes effect, so lookups in either direction are binary searches.
+// If a loop is set, positions past its end are folded back into it.
+class TempoMap {
+public:
+  TempoMap(double initialTickLength = 1.0 / 60.0);
+
+  // Changes must be added in tick order. A later change at the same tick
+  // replaces the earlier one.
+  void addChange(uint64_t tick, double tickLength);
+  // Ticks from loopEnd onward repeat the tempo changes in [loopStart, loopEnd).
+  // Call this after all changes have been added.
+  void setLoop(uint64_t loopStart, uint64_t loopEnd);
+
+  double tickToTime(uint64_t tick) const;
+  double timeToTick(double time) const;
+  // Length of a tick, in seconds, at the given tick.
+  double tickLength(uint64_t tick) const;
+
+private:
+  struct Change {
+    uint64_t tick;
+    double time;
+    double tickLength;
+  };
+
+  const Change& changeAtTick(uint64_t tick) const;
+  const Change& changeAtTime(double time) const;
+  double unfoldedTime(uint64_t tick) const;
+
+  std::vector<Change> changes;
+  uint64_t loopStart, loopEnd;
+  double loopStartTime, loopEndTime;
+};
+
+#endif
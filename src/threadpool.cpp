@@ -0,0 +1,143 @@
+#include "threadpool.h"
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace {
+struct ParallelJob {
+  ParallelJob(size_t count, size_t grain, const std::function<void(size_t, size_t)>* fn)
+  : fn(fn), count(count), grain(grain), numChunks((count + grain - 1) / grain), next(0), done(0)
+  {
+    // initializers only
+  }
+
+  void runChunks()
+  {
+    while (true) {
+      size_t chunk = next++;
+      if (chunk >= numChunks) {
+        return;
+      }
+      size_t start = chunk * grain;
+      size_t end = start + grain < count ? start + grain : count;
+      try {
+        (*fn)(start, end);
+      } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!error) {
+          error = std::current_exception();
+        }
+      }
+      std::lock_guard<std::mutex> guard(lock);
+      if (++done == numChunks) {
+        finished.notify_all();
+      }
+    }
+  }
+
+  // Only dereferenced after claiming a chunk, and the caller does not return
+  // until every claimed chunk is done, so a borrowed pointer is safe here.
+  const std::function<void(size_t, size_t)>* fn;
+  const size_t count, grain, numChunks;
+  std::atomic<size_t> next;
+  size_t done;
+  std::exception_ptr error;
+  std::mutex lock;
+  std::condition_variable finished;
+};
+}
+
+ThreadPool* ThreadPool::instance()
+{
+  static ThreadPool* pool = new ThreadPool;
+  return pool;
+}
+
+ThreadPool::ThreadPool(int numThreads)
+: numThreads(numThreads), quit(false)
+{
+  if (this->numThreads < 1) {
+    this->numThreads = std::thread::hardware_concurrency();
+  }
+  if (this->numThreads < 1) {
+    this->numThreads = 1;
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    quit = true;
+  }
+  wake.notify_all();
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::startWorkers()
+{
+  // Called with the lock held
+  if (workers.size()) {
+    return;
+  }
+  for (int i = 1; i < numThreads; i++) {
+    workers.emplace_back(&ThreadPool::workerLoop, this);
+  }
+}
+
+void ThreadPool::workerLoop()
+{
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]{ return quit || !queue.empty(); });
+      if (quit) {
+        return;
+      }
+      task = std::move(queue.front());
+      queue.pop_front();
+    }
+    task();
+  }
+}
+
+void ThreadPool::parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn)
+{
+  if (!count) {
+    return;
+  }
+  if (grain < 1) {
+    grain = 1;
+  }
+  size_t numChunks = (count + grain - 1) / grain;
+  if (numChunks == 1 || numThreads == 1) {
+    for (size_t start = 0; start < count; start += grain) {
+      fn(start, start + grain < count ? start + grain : count);
+    }
+    return;
+  }
+
+  std::shared_ptr<ParallelJob> job(new ParallelJob(count, grain, &fn));
+  size_t helpers = numChunks - 1;
+  if (helpers > size_t(numThreads - 1)) {
+    helpers = numThreads - 1;
+  }
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    startWorkers();
+    for (size_t i = 0; i < helpers; i++) {
+      queue.emplace_back([job]{ job->runChunks(); });
+    }
+  }
+  wake.notify_all();
+
+  job->runChunks();
+  std::unique_lock<std::mutex> guard(job->lock);
+  job->finished.wait(guard, [&job]{ return job->done == job->numChunks; });
+  if (job->error) {
+    std::rethrow_exception(job->error);
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef GBAMP2WAV_THREADPOOL_H
+#define GBAMP2WAV_THREADPOOL_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class ThreadPool {
+public:
+  // Process-wide pool sized to the number of hardware threads. It is never
+  // destroyed so that worker threads are not joined from a library unload.
+  static ThreadPool* instance();
+
+  ThreadPool(int numThreads = -1);
+  ThreadPool(const ThreadPool& other) = delete;
+  ThreadPool& operator=(const ThreadPool& other) = delete;
+  ~ThreadPool();
+
+  inline int size() const { return numThreads; }
+
+  // Calls fn(start, end) for consecutive ranges of at most `grain` items covering
+  // [0, count). The calling thread takes ranges too, so nested calls can't
+  // deadlock. The first exception thrown by fn is rethrown once all ranges finish.
+  void parallelFor(size_t count, size_t grain, const std::function<void(size_t, size_t)>& fn);
+
+private:
+  void startWorkers();
+  void workerLoop();
+
+  int numThreads;
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> queue;
+  std::mutex lock;
+  std::condition_variable wake;
+  bool quit;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "trace.h"
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+struct EventInfo {
+  const char* name;
+  const char* args[3];
+};
+
+const EventInfo eventInfo[Trace::NumEvents] = {
+  { "InstrumentChange", { "track", "instrument", "type" } },
+  { "UnknownParam", { "track", "param", nullptr } },
+  { "NoteWithoutInstrument", { "track", "note", nullptr } },
+};
+
+const char* const levelNames[] = { "error", "warning", "info", "debug" };
+
+struct Record {
+  uint64_t time;
+  Trace::Level level;
+  Trace::Event event;
+  int64_t args[3];
+};
+}
+
+#ifdef MP2K_ENABLE_TRACE
+namespace {
+static constexpr size_t RING_SIZE = 4096;
+
+// Single-producer ring. Each slot carries a sequence number so that a reader
+// can tell whether the slot was overwritten while it was being copied.
+struct Ring {
+  Ring(int thread) : thread(thread), head(0)
+  {
+    for (Slot& slot : slots) {
+      slot.seq = 0;
+    }
+  }
+
+  struct Slot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> words[5];
+  };
+
+  void push(const Record& record)
+  {
+    uint64_t index = head.load(std::memory_order_relaxed);
+    Slot& slot = slots[index % RING_SIZE];
+    // Odd while the slot is being written
+    slot.seq.store(index * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.words[0].store(record.time, std::memory_order_relaxed);
+    slot.words[1].store(uint64_t(record.level) << 16 | record.event, std::memory_order_relaxed);
+    for (int i = 0; i < 3; i++) {
+      slot.words[i + 2].store(record.args[i], std::memory_order_relaxed);
+    }
+    slot.seq.store(index * 2 + 2, std::memory_order_release);
+    head.store(index + 1, std::memory_order_release);
+  }
+
+  void copy(std::vector<Record>& records) const
+  {
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t start = end > RING_SIZE ? end - RING_SIZE : 0;
+    for (uint64_t index = start; index < end; index++) {
+      const Slot& slot = slots[index % RING_SIZE];
+      uint64_t seq = slot.seq.load(std::memory_order_acquire);
+      uint64_t words[5];
+      for (int i = 0; i < 5; i++) {
+        words[i] = slot.words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (seq != index * 2 + 2 || slot.seq.load(std::memory_order_relaxed) != seq) {
+        // Overwritten by a newer event
+        continue;
+      }
+      Record record;
+      record.time = words[0];
+      record.level = Trace::Level((words[1] >> 16) & 0xFF);
+      record.event = Trace::Event(words[1] & 0xFFFF);
+      for (int i = 0; i < 3; i++) {
+        record.args[i] = int64_t(words[i + 2]);
+      }
+      records.push_back(record);
+    }
+  }
+
+  const int thread;
+  std::atomic<uint64_t> head;
+  Slot slots[RING_SIZE];
+};
+
+std::atomic<int> traceLevel(Trace::Debug);
+const auto traceStart = std::chrono::steady_clock::now();
+std::mutex ringLock;
+// Rings outlive their threads so that their events can still be dumped.
+std::vector<std::unique_ptr<Ring>> rings;
+thread_local Ring* threadRing = nullptr;
+
+Ring* currentRing()
+{
+  if (!threadRing) {
+    std::lock_guard<std::mutex> guard(ringLock);
+    rings.emplace_back(new Ring(rings.size()));
+    threadRing = rings.back().get();
+  }
+  return threadRing;
+}
+
+std::vector<std::pair<int, Record>> collect()
+{
+  std::vector<std::pair<int, Record>> result;
+  std::lock_guard<std::mutex> guard(ringLock);
+  for (const auto& ring : rings) {
+    std::vector<Record> records;
+    ring->copy(records);
+    for (const Record& record : records) {
+      result.emplace_back(ring->thread, record);
+    }
+  }
+  return result;
+}
+}
+
+void Trace::setLevel(Level level)
+{
+  traceLevel = level;
+}
+
+bool Trace::isEnabled(Level level)
+{
+  return level <= traceLevel.load(std::memory_order_relaxed);
+}
+
+void Trace::record(Level level, Event event, int64_t arg0, int64_t arg1, int64_t arg2)
+{
+  if (event >= NumEvents) {
+    return;
+  }
+  Record record;
+  record.time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceStart).count();
+  record.level = level;
+  record.event = event;
+  record.args[0] = arg0;
+  record.args[1] = arg1;
+  record.args[2] = arg2;
+  currentRing()->push(record);
+}
+#else
+namespace {
+std::vector<std::pair<int, Record>> collect()
+{
+  return std::vector<std::pair<int, Record>>();
+}
+}
+
+void Trace::setLevel(Level)
+{
+  // tracing disabled
+}
+
+bool Trace::isEnabled(Level)
+{
+  return false;
+}
+
+void Trace::record(Level, Event, int64_t, int64_t, int64_t)
+{
+  // tracing disabled
+}
+#endif
+
+static void writeArgs(std::ostream& out, const Record& record)
+{
+  const EventInfo& info = eventInfo[record.event];
+  out << "{";
+  for (int i = 0; i < 3 && info.args[i]; i++) {
+    out << (i ? ", " : "") << "\"" << info.args[i] << "\": " << record.args[i];
+  }
+  out << "}";
+}
+
+void Trace::dumpJson(std::ostream& out)
+{
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  // Timestamps are in microseconds
+  out << std::fixed << std::setprecision(3) << "[";
+  bool first = true;
+  for (const auto& iter : collect()) {
+    const Record& record = iter.second;
+    out << (first ? "\n" : ",\n") << "  { \"thread\": " << iter.first << ", \"time\": " << record.time / 1000.0
+      << ", \"level\": \"" << levelNames[record.level] << "\", \"event\": \"" << eventInfo[record.event].name << "\", \"args\": ";
+    writeArgs(out, record);
+    out << " }";
+    first = false;
+  }
+  out << "\n]" << std::endl;
+  out.flags(flags);
+  out.precision(precision);
+}
+
+void Trace::dumpChromeTrace(std::ostream& out)
+{
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision();
+  out << std::fixed << std::setprecision(3) << "{ \"traceEvents\": [";
+  bool first = true;
+  for (const auto& iter : collect()) {
+    const Record& record = iter.second;
+    out << (first ? "\n" : ",\n") << "  { \"name\": \"" << eventInfo[record.event].name << "\", \"cat\": \"" << levelNames[record.level]
+      << "\", \"ph\": \"i\", \"s\": \"t\", \"ts\": " << record.time / 1000.0 << ", \"pid\": 1, \"tid\": " << iter.first << ", \"args\": ";
+    writeArgs(out, record);
+    out << " }";
+    first = false;
+  }
+  out << "\n] }" << std::endl;
+  out.flags(flags);
+  out.precision(precision);
+}
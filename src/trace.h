@@ -0,0 +1,51 @@
+#ifndef GBAMP2WAV_TRACE_H
+#define GBAMP2WAV_TRACE_H
+
+#include <cstdint>
+#include <iostream>
+
+// Diagnostics from the playback path. Define MP2K_ENABLE_TRACE (`make TRACE=1`)
+// to record them; otherwise MP2K_TRACE() compiles to nothing and its arguments
+// are never evaluated.
+//
+// Each thread records fixed-size binary events into its own ring buffer, so
+// recording never locks, allocates or writes to a stream after the thread's
+// first event. When a ring fills up, its oldest events are overwritten. The
+// rings can be dumped at any time as JSON or in Chrome's trace event format.
+namespace Trace {
+  enum Level {
+    Error = 0,
+    Warning = 1,
+    Info = 2,
+    Debug = 3,
+  };
+
+  enum Event {
+    // track, instrument ID, instrument type (-1 if missing)
+    InstrumentChange,
+    // track, parameter
+    UnknownParam,
+    // track, note
+    NoteWithoutInstrument,
+    NumEvents
+  };
+
+  // Events less severe than `level` are discarded. Defaults to Debug.
+  void setLevel(Level level);
+  bool isEnabled(Level level);
+
+  void record(Level level, Event event, int64_t arg0 = 0, int64_t arg1 = 0, int64_t arg2 = 0);
+
+  // Writes an array of event objects.
+  void dumpJson(std::ostream& out);
+  // Loadable in chrome://tracing or Perfetto.
+  void dumpChromeTrace(std::ostream& out);
+}
+
+#ifdef MP2K_ENABLE_TRACE
+#define MP2K_TRACE(level, ...) do { if (Trace::isEnabled(Trace::level)) Trace::record(Trace::level, __VA_ARGS__); } while (0)
+#else
+#define MP2K_TRACE(level, ...) do {} while (0)
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef GBAMP2WAV_VOICETABLE_H
+#define GBAMP2WAV_VOICETABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#if defined(_MSC_VER) && !defined(__GNUC__)
+#include <intrin.h>
+#endif
+
+// Fixed-size table of per-voice state indexed by a small integer key. A
+// bitmask tracks which slots are occupied, so inserting, replacing and
+// removing an entry never allocates, and iteration skips empty words.
+template<typename T, size_t N>
+class VoiceTable {
+public:
+  VoiceTable() { clear(); }
+
+  inline bool contains(size_t key) const { return mask[key / 64] & (uint64_t(1) << (key % 64)); }
+  inline T* find(size_t key) { return contains(key) ? &slots[key] : nullptr; }
+  inline const T* find(size_t key) const { return contains(key) ? &slots[key] : nullptr; }
+
+  inline void set(size_t key, const T& value)
+  {
+    slots[key] = value;
+    mask[key / 64] |= uint64_t(1) << (key % 64);
+  }
+
+  inline void erase(size_t key) { mask[key / 64] &= ~(uint64_t(1) << (key % 64)); }
+
+  inline void clear()
+  {
+    for (uint64_t& word : mask) {
+      word = 0;
+    }
+  }
+
+  inline bool empty() const
+  {
+    for (uint64_t word : mask) {
+      if (word) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Calls fn(key, value) for every occupied slot in key order.
+  template<typename Fn> void forEach(Fn fn) const
+  {
+    for (size_t i = 0; i < WORDS; i++) {
+      for (uint64_t word = mask[i]; word; word &= word - 1) {
+        size_t key = i * 64 + lowestBit(word);
+        fn(key, slots[key]);
+      }
+    }
+  }
+
+private:
+  static constexpr size_t WORDS = (N + 63) / 64;
+
+  // Index of the lowest set bit. The word must not be zero.
+  static inline size_t lowestBit(uint64_t word)
+  {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long bit;
+    _BitScanForward64(&bit, word);
+    return bit;
+#else
+    // Isolating the lowest bit and multiplying by a de Bruijn sequence leaves
+    // a unique pattern in the top six bits for each position.
+    static const uint8_t positions[64] = {
+      0, 47, 1, 56, 48, 27, 2, 60, 57, 49, 41, 37, 28, 16, 3, 61,
+      54, 58, 35, 52, 50, 42, 21, 44, 38, 32, 29, 23, 17, 11, 4, 62,
+      46, 55, 26, 59, 40, 36, 15, 53, 34, 51, 20, 43, 31, 22, 10, 45,
+      25, 39, 14, 33, 19, 30, 9, 24, 13, 18, 8, 12, 7, 6, 5, 63,
+    };
+    return positions[((word ^ (word - 1)) * 0x03F79D71B4CB0A89ULL) >> 58];
+#endif
+  }
+
+  T slots[N];
+  uint64_t mask[WORDS];
+};
+
+#endif